@@ -36,6 +36,51 @@
 #define ATBUILTIN_RWLOCK_READ_PRIORITY  0
 #define ATBUILTIN_RWLOCK_NO_PRIORITY    1
 #define ATBUILTIN_RWLOCK_WRITE_PRIORITY 2
+#define ATBUILTIN_RWLOCK_PHASE_FAIR     3
+#define ATBUILTIN_RWLOCK_ADAPTIVE       4
+
+#define ATBUILTIN_RWLOCK_WAIT_PTHREAD   0
+#define ATBUILTIN_RWLOCK_WAIT_FUTEX     1
+#define ATBUILTIN_RWLOCK_WAIT_QUEUE     2
+#define ATBUILTIN_RWLOCK_WAIT_SPIN      3
+#define ATBUILTIN_RWLOCK_WAIT_PI        4
+
+#define ATBUILTIN_RWLOCK_SPIN_FIXED     0
+#define ATBUILTIN_RWLOCK_SPIN_ADAPTIVE  1
+
+#define ATBUILTIN_RWLOCK_BACKOFF_NONE        0
+#define ATBUILTIN_RWLOCK_BACKOFF_EXPONENTIAL 1
+
+#define ATBUILTIN_RWLOCK_READ_COUNTER_SHARED 0
+#define ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU 1
+
+#define ATBUILTIN_RWLOCK_BIAS_NONE 0
+#define ATBUILTIN_RWLOCK_BIAS_READ 1
+
+#define ATBUILTIN_RWLOCK_COHORT_NONE 0
+#define ATBUILTIN_RWLOCK_COHORT_NUMA 1
+#define ATBUILTIN_RWLOCK_COHORT_BATCH 64
+
+#define ATBUILTIN_RWLOCK_QUEUE_ORDER_FIFO     0
+#define ATBUILTIN_RWLOCK_QUEUE_ORDER_DEADLINE 1
+
+#define ATBUILTIN_RWLOCK_CACHE_LINE_SIZE 64
+
+#define ATBUILTIN_RWLOCK_ARRAY_HUGEPAGE   1
+#define ATBUILTIN_RWLOCK_ARRAY_LOCAL_NODE 2
+
+/*
+  Static initializer of atbuiltin_rwlock_t, same as atbuiltin_rwlock_init
+  without attr. atbuiltin_rwlock_init without attr sets every field to 0,
+  except the lock functions, which are NULL here and then called as the
+  read priority functions which it sets. Zeroed memory is also an
+  initialized lock. The mutex and the condition variable are set up when
+  the lock is contended first.
+*/
+#define ATBUILTIN_RWLOCK_INITIALIZER {0}
+
+/* clockid of atbuiltin_rwlock_timedrlock and atbuiltin_rwlock_timedwlock */
+#define ATBUILTIN_RWLOCK_TIMEOUT_RELATIVE ((clockid_t) -1)
 
 #if __GNUC__ > 4 || \
   (__GNUC__ == 4 && (__GNUC_MINOR__ > 7 || \
@@ -46,15 +91,42 @@
   #endif
 #endif
 
-#ifdef ATBUILTIN_RWLOCK_USE_LONG_LONG_FOR_LOCK_BODY
-  #define atbuiltin_rwlock_signed long long int
-  #define atbuiltin_rwlock_unsigned unsigned long long int
-  #define ATBUILTIN_RWLOCK_MIN_VAL LLONG_MIN
-#else
-  #define atbuiltin_rwlock_signed int
-  #define atbuiltin_rwlock_unsigned unsigned int
-  #define ATBUILTIN_RWLOCK_MIN_VAL INT_MIN
-#endif
+/*
+  lock_body packs the whole lock state into one 64bit word.
+  bit  0-19: readers which hold the lock
+  bit 20-38: readers which wait for a writer
+  bit 39-57: writers which hold or wait for the lock
+  bit 58   : flipped when waiting readers are given the lock together
+  bit 60   : a writer waits for readers, new readers must wait
+  bit 61   : a writer holds the lock
+  bit 62-63: priority of this lock
+*/
+#define atbuiltin_rwlock_state unsigned long long int
+#define ATBUILTIN_RWLOCK_READER_ONE       0x0000000000000001ULL
+#define ATBUILTIN_RWLOCK_READER_MASK      0x00000000000FFFFFULL
+#define ATBUILTIN_RWLOCK_READ_WAITER_ONE  0x0000000000100000ULL
+#define ATBUILTIN_RWLOCK_READ_WAITER_MASK 0x0000007FFFF00000ULL
+#define ATBUILTIN_RWLOCK_WRITER_ONE       0x0000008000000000ULL
+#define ATBUILTIN_RWLOCK_WRITER_MASK      0x03FFFF8000000000ULL
+#define ATBUILTIN_RWLOCK_READ_PHASE       0x0400000000000000ULL
+#define ATBUILTIN_RWLOCK_WRITE_WAITING    0x1000000000000000ULL
+#define ATBUILTIN_RWLOCK_WRITE_LOCKED     0x2000000000000000ULL
+#define ATBUILTIN_RWLOCK_PRIORITY_SHIFT   62
+#define ATBUILTIN_RWLOCK_PRIORITY_MASK    0xC000000000000000ULL
+
+/*
+  lock_body of atbuiltin_rwlock_compact_t.
+  bit  0-60: readers which hold the lock
+  bit 61   : writers are parked, new readers must wait
+  bit 62   : readers are parked
+  bit 63   : a writer holds the lock
+*/
+#define ATBUILTIN_RWLOCK_COMPACT_READER_ONE    0x0000000000000001ULL
+#define ATBUILTIN_RWLOCK_COMPACT_READER_MASK   0x1FFFFFFFFFFFFFFFULL
+#define ATBUILTIN_RWLOCK_COMPACT_WRITE_PARKED  0x2000000000000000ULL
+#define ATBUILTIN_RWLOCK_COMPACT_READ_PARKED   0x4000000000000000ULL
+#define ATBUILTIN_RWLOCK_COMPACT_WRITE_LOCKED  0x8000000000000000ULL
+#define ATBUILTIN_RWLOCK_COMPACT_INITIALIZER {0}
 
 #ifdef ATBUILTIN_RWLOCK_USE_SYNC_BUILTIN
   #define ATBUILTIN_RWLOCK_RELAXED
@@ -69,6 +141,14 @@
     __sync_add_and_fetch(A, B)
   #define atbuiltin_sub_and_fetch(A, B, C) \
     __sync_sub_and_fetch(A, B)
+  #define atbuiltin_load_n(A, B) \
+    __sync_add_and_fetch(A, 0)
+  #define atbuiltin_exchange_n(A, B, C) \
+    (__sync_synchronize(), __sync_lock_test_and_set(A, B))
+  #define atbuiltin_store_n(A, B, C) \
+    ((void) atbuiltin_exchange_n(A, B, C))
+  #define atbuiltin_thread_fence(A) \
+    __sync_synchronize()
 #else
   #define ATBUILTIN_RWLOCK_RELAXED __ATOMIC_RELAXED
   #define ATBUILTIN_RWLOCK_CONSUME __ATOMIC_CONSUME
@@ -82,6 +162,14 @@
     __atomic_add_fetch(A, B, C)
   #define atbuiltin_sub_and_fetch(A, B, C) \
     __atomic_sub_fetch(A, B, C)
+  #define atbuiltin_load_n(A, B) \
+    __atomic_load_n(A, B)
+  #define atbuiltin_exchange_n(A, B, C) \
+    __atomic_exchange_n(A, B, C)
+  #define atbuiltin_store_n(A, B, C) \
+    __atomic_store_n(A, B, C)
+  #define atbuiltin_thread_fence(A) \
+    __atomic_thread_fence(A)
 #endif
 
 #ifdef ATBUILTIN_RWLOCK_USE_STRONG_FOR_CAS
@@ -95,25 +183,152 @@ struct atbuiltin_rwlock_attr_t
   pthread_mutexattr_t mutex_attr;
   pthread_condattr_t cond_attr;
   int rwlock_attr;
+  int wait_attr;
+  int spin_attr;
+  int backoff_attr;
+  int read_counter_attr;
+  int bias_attr;
+  int cohort_attr;
+  int cohort_batch_attr;
+  int queue_order_attr;
+  unsigned long long int wait_spin_limit;
   unsigned long long int write_lock_interval;
+  unsigned long long int write_wait_cap;
+  unsigned int write_batch;
+  unsigned long long int write_batch_time;
+  unsigned int read_max;
+};
+
+struct atbuiltin_rwlock_backoff_t
+{
+  unsigned int count;
+  unsigned int seed;
+  unsigned long long int spin_steps;
+  unsigned long long int sleeps;
+  unsigned long long int sleep_nsec;
+};
+
+struct atbuiltin_rwlock_backoff_stat_t
+{
+  unsigned long long int spin_steps;
+  unsigned long long int sleeps;
+  unsigned long long int sleep_nsec;
 };
 
+struct atbuiltin_rwlock_adaptive_stat_t
+{
+  int priority;
+  unsigned long long int switches;
+};
+
+struct atbuiltin_rwlock_read_slot_t
+{
+  long long int readers;
+  char pad[ATBUILTIN_RWLOCK_CACHE_LINE_SIZE - sizeof(long long int)];
+};
+
+struct atbuiltin_rwlock_cohort_node_t
+{
+  int mutex;
+  int waiters;
+  int global_held;
+  int batch_count;
+  char pad[ATBUILTIN_RWLOCK_CACHE_LINE_SIZE - sizeof(int) * 4];
+};
+
+struct atbuiltin_rwlock_queue_node_t;
+
+/*
+  Fields of atbuiltin_rwlock_t are grouped by who touches them. lock_body,
+  which every reader and writer writes, comes first. The fields which
+  readers read on each lock and unlock follow it, and they are written only
+  by init, atbuiltin_rwlock_set_read_max and the priority switch of
+  ATBUILTIN_RWLOCK_ADAPTIVE. The fields which writers and waiting threads
+  write, such as write_seq, come last. With
+  -DATBUILTIN_RWLOCK_USE_CACHE_LINE_LAYOUT, each group starts at a new cache
+  line and the lock itself is aligned to a cache line, so the fields which
+  readers read stay in the cache of readers while writers and waiters work
+  on lock_body and their own fields.
+*/
+#ifdef ATBUILTIN_RWLOCK_USE_CACHE_LINE_LAYOUT
+  #define ATBUILTIN_RWLOCK_CACHE_ALIGNED \
+    __attribute__((aligned(ATBUILTIN_RWLOCK_CACHE_LINE_SIZE)))
+#else
+  #define ATBUILTIN_RWLOCK_CACHE_ALIGNED
+#endif
+
 struct atbuiltin_rwlock_t
 {
-  atbuiltin_rwlock_signed lock_body;
-  atbuiltin_rwlock_unsigned writer_count;
-  volatile atbuiltin_rwlock_unsigned tr_waiter_count;
-  unsigned long long int write_lock_interval;
-  struct timespec write_lock_interval_ts;
-  volatile bool read_waiting;
-  volatile bool write_waiting;
-  pthread_mutex_t mutex;
-  pthread_cond_t cond;
-  int (*timedrlock)(atbuiltin_rwlock_t *lock, const struct timespec *timeout);
+  atbuiltin_rwlock_state lock_body ATBUILTIN_RWLOCK_CACHE_ALIGNED;
+  unsigned int read_max ATBUILTIN_RWLOCK_CACHE_ALIGNED;
+  int adaptive_type;
+  int wait_type;
+  int read_counter_type;
+  int read_slot_count;
+  atbuiltin_rwlock_read_slot_t *read_slots;
+  int bias_type;
+  int read_bias;
+  int cohort_type;
+  int cohort_node_count;
+  atbuiltin_rwlock_cohort_node_t *cohort_nodes;
+  int (*timedrlock)(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid);
   int (*rlock)(atbuiltin_rwlock_t *lock);
-  int (*timedwlock)(atbuiltin_rwlock_t *lock, const struct timespec *timeout);
+  int (*timedwlock)(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid);
   int (*wlock)(atbuiltin_rwlock_t *lock);
   int (*wunlock)(atbuiltin_rwlock_t *lock);
+  unsigned int write_seq ATBUILTIN_RWLOCK_CACHE_ALIGNED;
+  unsigned long long int write_lock_interval;
+  unsigned long long int write_wait_cap;
+  unsigned int write_batch;
+  unsigned long long int write_batch_time;
+  unsigned int write_batch_count;
+  unsigned long long int write_batch_start;
+  unsigned long long int adaptive_ops;
+  unsigned long long int adaptive_read_wait;
+  unsigned long long int adaptive_write_wait;
+  unsigned long long int adaptive_switches;
+  int adaptive_streak;
+  int adaptive_direction;
+  int adaptive_reversals;
+  unsigned long long int wait_spin_limit;
+  int futex_shared;
+  int futex_mutex;
+  int futex_read_seq;
+  int write_owner;
+  int pi_waiter;
+  int drain_waiting;
+  int spin_type;
+  int mutex_spin_count;
+  int drain_spin_count;
+  int mutex_owner_cpu;
+  int backoff_type;
+  unsigned long long int backoff_spin_steps;
+  unsigned long long int backoff_sleeps;
+  unsigned long long int backoff_sleep_nsec;
+  unsigned long long int bias_inhibit_until;
+  int queue_lock;
+  int queue_order;
+  atbuiltin_rwlock_queue_node_t *queue_head;
+  atbuiltin_rwlock_queue_node_t *queue_tail;
+  int cohort_batch;
+  atbuiltin_rwlock_cohort_node_t *upgrade_node;
+  int wait_setup;
+  pthread_mutex_t mutex;
+  pthread_mutex_t cond_mutex;
+  pthread_cond_t cond;
+};
+
+struct atbuiltin_rwlock_compact_t
+{
+  atbuiltin_rwlock_state lock_body;
+};
+
+struct atbuiltin_rwlock_array_t
+{
+  void *memory;
+  size_t size;
+  size_t stride;
+  size_t count;
 };
 
 int atbuiltin_rwlockattr_setpshared_cond(atbuiltin_rwlock_attr_t *attr, int pshared);
@@ -124,17 +339,91 @@ int atbuiltin_rwlockattr_settype_mutex(atbuiltin_rwlock_attr_t *attr, int kind);
 int atbuiltin_rwlockattr_gettype_mutex(atbuiltin_rwlock_attr_t *attr, int *kind);
 int atbuiltin_rwlockattr_settype_priority(atbuiltin_rwlock_attr_t *attr, int priority);
 int atbuiltin_rwlockattr_gettype_priority(atbuiltin_rwlock_attr_t *attr, int *priority);
+int atbuiltin_rwlockattr_settype_wait(atbuiltin_rwlock_attr_t *attr, int wait);
+int atbuiltin_rwlockattr_gettype_wait(atbuiltin_rwlock_attr_t *attr, int *wait);
+int atbuiltin_rwlockattr_settype_wait_spin_limit(atbuiltin_rwlock_attr_t *attr, unsigned long long int limit);
+int atbuiltin_rwlockattr_gettype_wait_spin_limit(atbuiltin_rwlock_attr_t *attr, unsigned long long int *limit);
+int atbuiltin_rwlockattr_settype_spin(atbuiltin_rwlock_attr_t *attr, int spin);
+int atbuiltin_rwlockattr_gettype_spin(atbuiltin_rwlock_attr_t *attr, int *spin);
+int atbuiltin_rwlockattr_settype_backoff(atbuiltin_rwlock_attr_t *attr, int backoff);
+int atbuiltin_rwlockattr_gettype_backoff(atbuiltin_rwlock_attr_t *attr, int *backoff);
+int atbuiltin_rwlockattr_settype_read_counter(atbuiltin_rwlock_attr_t *attr, int read_counter);
+int atbuiltin_rwlockattr_gettype_read_counter(atbuiltin_rwlock_attr_t *attr, int *read_counter);
+int atbuiltin_rwlockattr_settype_bias(atbuiltin_rwlock_attr_t *attr, int bias);
+int atbuiltin_rwlockattr_gettype_bias(atbuiltin_rwlock_attr_t *attr, int *bias);
+int atbuiltin_rwlockattr_settype_cohort(atbuiltin_rwlock_attr_t *attr, int cohort);
+int atbuiltin_rwlockattr_gettype_cohort(atbuiltin_rwlock_attr_t *attr, int *cohort);
+int atbuiltin_rwlockattr_settype_cohort_batch(atbuiltin_rwlock_attr_t *attr, int batch);
+int atbuiltin_rwlockattr_gettype_cohort_batch(atbuiltin_rwlock_attr_t *attr, int *batch);
+int atbuiltin_rwlockattr_settype_queue_order(atbuiltin_rwlock_attr_t *attr, int order);
+int atbuiltin_rwlockattr_gettype_queue_order(atbuiltin_rwlock_attr_t *attr, int *order);
 int atbuiltin_rwlockattr_settype_write_lock_interval(atbuiltin_rwlock_attr_t *attr, unsigned long long int interval);
 int atbuiltin_rwlockattr_gettype_write_lock_interval(atbuiltin_rwlock_attr_t *attr, unsigned long long int *interval);
+int atbuiltin_rwlockattr_settype_write_wait_cap(atbuiltin_rwlock_attr_t *attr, unsigned long long int cap);
+int atbuiltin_rwlockattr_gettype_write_wait_cap(atbuiltin_rwlock_attr_t *attr, unsigned long long int *cap);
+int atbuiltin_rwlockattr_settype_write_batch(atbuiltin_rwlock_attr_t *attr, unsigned int batch);
+int atbuiltin_rwlockattr_gettype_write_batch(atbuiltin_rwlock_attr_t *attr, unsigned int *batch);
+int atbuiltin_rwlockattr_settype_write_batch_time(atbuiltin_rwlock_attr_t *attr, unsigned long long int batch_time);
+int atbuiltin_rwlockattr_gettype_write_batch_time(atbuiltin_rwlock_attr_t *attr, unsigned long long int *batch_time);
+int atbuiltin_rwlockattr_settype_read_max(atbuiltin_rwlock_attr_t *attr, unsigned int max);
+int atbuiltin_rwlockattr_gettype_read_max(atbuiltin_rwlock_attr_t *attr, unsigned int *max);
 int atbuiltin_rwlock_init(atbuiltin_rwlock_t *lock, const atbuiltin_rwlock_attr_t *attr);
 int atbuiltin_rwlock_destroy(atbuiltin_rwlock_t *lock);
 int atbuiltin_rwlock_tryrlock(atbuiltin_rwlock_t *lock);
-#define atbuiltin_rwlock_timedrlock(A, B) (A)->timedrlock(A, B)
-#define atbuiltin_rwlock_rlock(A) (A)->rlock(A)
+int atbuiltin_rwlock_static_timedrlock(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid);
+int atbuiltin_rwlock_static_rlock(atbuiltin_rwlock_t *lock);
+int atbuiltin_rwlock_static_timedwlock(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid);
+int atbuiltin_rwlock_static_wlock(atbuiltin_rwlock_t *lock);
+int atbuiltin_rwlock_static_wunlock(atbuiltin_rwlock_t *lock);
+/* a lock from ATBUILTIN_RWLOCK_INITIALIZER has no function pointers */
+#define atbuiltin_rwlock_timedrlock(A, B) \
+  ((A)->timedrlock ? \
+    (A)->timedrlock(A, B, ATBUILTIN_RWLOCK_TIMEOUT_RELATIVE) : \
+    atbuiltin_rwlock_static_timedrlock(A, B, ATBUILTIN_RWLOCK_TIMEOUT_RELATIVE))
+int atbuiltin_rwlock_clockrlock(atbuiltin_rwlock_t *lock, clockid_t clockid, const struct timespec *abstime);
+#define atbuiltin_rwlock_rlock(A) \
+  ((A)->rlock ? (A)->rlock(A) : atbuiltin_rwlock_static_rlock(A))
 int atbuiltin_rwlock_runlock(atbuiltin_rwlock_t *lock);
+int atbuiltin_rwlock_read_begin(atbuiltin_rwlock_t *lock, unsigned int *seq);
+int atbuiltin_rwlock_read_validate(atbuiltin_rwlock_t *lock, unsigned int seq);
 int atbuiltin_rwlock_trywlock(atbuiltin_rwlock_t *lock);
-#define atbuiltin_rwlock_timedwlock(A, B) (A)->timedwlock(A, B)
-#define atbuiltin_rwlock_wlock(A) (A)->wlock(A)
-#define atbuiltin_rwlock_wunlock(A) (A)->wunlock(A)
+#define atbuiltin_rwlock_timedwlock(A, B) \
+  ((A)->timedwlock ? \
+    (A)->timedwlock(A, B, ATBUILTIN_RWLOCK_TIMEOUT_RELATIVE) : \
+    atbuiltin_rwlock_static_timedwlock(A, B, ATBUILTIN_RWLOCK_TIMEOUT_RELATIVE))
+int atbuiltin_rwlock_clockwlock(atbuiltin_rwlock_t *lock, clockid_t clockid, const struct timespec *abstime);
+#define atbuiltin_rwlock_wlock(A) \
+  ((A)->wlock ? (A)->wlock(A) : atbuiltin_rwlock_static_wlock(A))
+#define atbuiltin_rwlock_wunlock(A) \
+  ((A)->wunlock ? (A)->wunlock(A) : atbuiltin_rwlock_static_wunlock(A))
+int atbuiltin_rwlock_tryulock(atbuiltin_rwlock_t *lock);
+int atbuiltin_rwlock_timedulock(atbuiltin_rwlock_t *lock, const struct timespec *timeout);
+int atbuiltin_rwlock_ulock(atbuiltin_rwlock_t *lock);
+int atbuiltin_rwlock_uunlock(atbuiltin_rwlock_t *lock);
+int atbuiltin_rwlock_upgrade(atbuiltin_rwlock_t *lock);
+int atbuiltin_rwlock_downgrade(atbuiltin_rwlock_t *lock);
+int atbuiltin_rwlock_backoff_init(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_backoff_t *backoff);
+int atbuiltin_rwlock_backoff(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_backoff_t *backoff);
+int atbuiltin_rwlock_backoff_destroy(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_backoff_t *backoff);
+int atbuiltin_rwlock_getstat_backoff(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_backoff_stat_t *stat);
+int atbuiltin_rwlock_getstat_adaptive(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_adaptive_stat_t *stat);
+int atbuiltin_rwlock_set_read_max(atbuiltin_rwlock_t *lock, unsigned int max);
+int atbuiltin_rwlock_get_read_max(atbuiltin_rwlock_t *lock, unsigned int *max);
+int atbuiltin_rwlock_compact_init(atbuiltin_rwlock_compact_t *lock);
+int atbuiltin_rwlock_compact_destroy(atbuiltin_rwlock_compact_t *lock);
+int atbuiltin_rwlock_compact_tryrlock(atbuiltin_rwlock_compact_t *lock);
+int atbuiltin_rwlock_compact_timedrlock(atbuiltin_rwlock_compact_t *lock, const struct timespec *timeout);
+int atbuiltin_rwlock_compact_clockrlock(atbuiltin_rwlock_compact_t *lock, clockid_t clockid, const struct timespec *abstime);
+int atbuiltin_rwlock_compact_rlock(atbuiltin_rwlock_compact_t *lock);
+int atbuiltin_rwlock_compact_runlock(atbuiltin_rwlock_compact_t *lock);
+int atbuiltin_rwlock_compact_trywlock(atbuiltin_rwlock_compact_t *lock);
+int atbuiltin_rwlock_compact_timedwlock(atbuiltin_rwlock_compact_t *lock, const struct timespec *timeout);
+int atbuiltin_rwlock_compact_clockwlock(atbuiltin_rwlock_compact_t *lock, clockid_t clockid, const struct timespec *abstime);
+int atbuiltin_rwlock_compact_wlock(atbuiltin_rwlock_compact_t *lock);
+int atbuiltin_rwlock_compact_wunlock(atbuiltin_rwlock_compact_t *lock);
+int atbuiltin_rwlock_array_init(atbuiltin_rwlock_array_t *array, size_t count, const atbuiltin_rwlock_attr_t *attr, int flags);
+int atbuiltin_rwlock_array_destroy(atbuiltin_rwlock_array_t *array);
+#define atbuiltin_rwlock_array_get(A, B) \
+  ((atbuiltin_rwlock_t *) ((char *) (A)->memory + (size_t) (B) * (A)->stride))
 
 #endif /* _ATBUILTIN_RWLOCK_H */
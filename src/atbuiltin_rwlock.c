@@ -28,23 +28,43 @@
   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <atbuiltin_rwlock.h>
 
-static int atbuiltin_rwlock_timedrlock_read_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout);
-static int atbuiltin_rwlock_rlock_read_priority(atbuiltin_rwlock_t *lock);
-static int atbuiltin_rwlock_timedwlock_read_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout);
+#if defined(__GLIBC__) && defined(__USE_GNU) && \
+  (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30))
+  #define ATBUILTIN_RWLOCK_HAVE_CLOCKWAIT
+#endif
+
+static int atbuiltin_rwlock_timedrlock_any_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid);
+static int atbuiltin_rwlock_rlock_any_priority(atbuiltin_rwlock_t *lock);
+static int atbuiltin_rwlock_timedwlock_read_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid);
 static int atbuiltin_rwlock_wlock_read_priority(atbuiltin_rwlock_t *lock);
 static int atbuiltin_rwlock_wunlock_read_priority(atbuiltin_rwlock_t *lock);
-static int atbuiltin_rwlock_timedrlock_no_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout);
-static int atbuiltin_rwlock_rlock_no_priority(atbuiltin_rwlock_t *lock);
-static int atbuiltin_rwlock_timedwlock_no_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout);
+static int atbuiltin_rwlock_timedwlock_no_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid);
 static int atbuiltin_rwlock_wlock_no_priority(atbuiltin_rwlock_t *lock);
 static int atbuiltin_rwlock_wunlock_no_priority(atbuiltin_rwlock_t *lock);
-static int atbuiltin_rwlock_timedrlock_write_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout);
-static int atbuiltin_rwlock_rlock_write_priority(atbuiltin_rwlock_t *lock);
-static int atbuiltin_rwlock_timedwlock_write_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout);
+static int atbuiltin_rwlock_timedwlock_write_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid);
 static int atbuiltin_rwlock_wlock_write_priority(atbuiltin_rwlock_t *lock);
 static int atbuiltin_rwlock_wunlock_write_priority(atbuiltin_rwlock_t *lock);
+static int atbuiltin_rwlock_timedwlock_phase_fair(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid);
+static int atbuiltin_rwlock_wlock_phase_fair(atbuiltin_rwlock_t *lock);
+static int atbuiltin_rwlock_wunlock_phase_fair(atbuiltin_rwlock_t *lock);
+static int atbuiltin_rwlock_timedrlock_queue(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid);
+static int atbuiltin_rwlock_rlock_queue(atbuiltin_rwlock_t *lock);
+static int atbuiltin_rwlock_timedwlock_queue(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid);
+static int atbuiltin_rwlock_wlock_queue(atbuiltin_rwlock_t *lock);
+static int atbuiltin_rwlock_wunlock_queue(atbuiltin_rwlock_t *lock);
+static inline int atbuiltin_queue_write_trylock(atbuiltin_rwlock_t *lock);
+static inline int atbuiltin_busy_mutex_timedlock(atbuiltin_rwlock_t *lock, const struct timespec *abstime);
+static inline void atbuiltin_rwlock_write_exit(atbuiltin_rwlock_t *lock, int priority, bool locked);
+static inline void atbuiltin_rwlock_read_granted(atbuiltin_rwlock_t *lock);
 
 static void get_timespec_from_nanosec(struct timespec *ts, unsigned long long int nanosec)
 {
@@ -52,1031 +72,4303 @@ static void get_timespec_from_nanosec(struct timespec *ts, unsigned long long in
   ts->tv_nsec = nanosec % 1000000000;
 }
 
-static struct timespec *get_smaller_timespec(struct timespec *ts1, struct timespec *ts2)
+static unsigned long long int get_nanosec_from_timespec(const struct timespec *ts)
 {
-  if (ts1->tv_sec > ts2->tv_sec)
-    return ts2;
-  else if (ts1->tv_sec < ts2->tv_sec)
-    return ts1;
-  else if (ts1->tv_nsec > ts2->tv_nsec)
-    return ts2;
-  return ts1;
+  return (unsigned long long int) ts->tv_sec * 1000000000 + ts->tv_nsec;
 }
 
-static bool timespec_sub(struct timespec *tsr, const struct timespec *tss, const struct timespec *tse)
+/*
+  Timed functions turn a timeout relative to now, or an absolute deadline of
+  CLOCK_REALTIME, into an absolute deadline of CLOCK_MONOTONIC once when they
+  have to wait. Every wait below takes that deadline and hands it to the
+  kernel as it is, so the clock is read again only when a wait times out
+  before it, or by waits which never sleep. Unless tss is NULL, it is set to
+  the time when the clock was read, which ATBUILTIN_RWLOCK_ADAPTIVE samples.
+*/
+static inline void atbuiltin_deadline_init(struct timespec *abstime, struct timespec *tss, const struct timespec *timeout, clockid_t clockid)
 {
-  time_t tv_sec = (tse->tv_sec > tss->tv_sec ? tse->tv_sec - tss->tv_sec : 0);
-  long tv_nsec;
-  if (tse->tv_nsec >= tss->tv_nsec)
+  struct timespec tsn, tsc;
+  if (clockid == CLOCK_MONOTONIC)
   {
-    tv_nsec = tse->tv_nsec - tss->tv_nsec;
-  } else if (tv_sec > 0) {
-    tv_sec--;
-    tv_nsec = 1000000000 - tss->tv_nsec + tse->tv_nsec;
-  } else {
-    tv_nsec = 0;
-  }
-  if (
-    tsr->tv_sec > tv_sec ||
-    (tsr->tv_sec == tv_sec && tsr->tv_nsec > tv_nsec)
-  ) {
-    tsr->tv_sec -= tv_sec;
-    if (tsr->tv_nsec >= tv_nsec)
+    *abstime = *timeout;
+    if (tss)
     {
-      tsr->tv_nsec -= tv_nsec;
-    } else {
-      tsr->tv_sec--;
-      tsr->tv_nsec = 1000000000 - tsr->tv_nsec + tv_nsec;
+      clock_gettime(CLOCK_MONOTONIC, tss);
     }
-  } else {
-    return true;
+    return;
   }
-  return false;
+  if (!tss)
+  {
+    tss = &tsn;
+  }
+  clock_gettime(CLOCK_MONOTONIC, tss);
+  if (clockid == CLOCK_REALTIME)
+  {
+    clock_gettime(CLOCK_REALTIME, &tsc);
+    get_timespec_from_nanosec(abstime, get_nanosec_from_timespec(tss) +
+      (get_nanosec_from_timespec(timeout) > get_nanosec_from_timespec(&tsc) ?
+      get_nanosec_from_timespec(timeout) - get_nanosec_from_timespec(&tsc) :
+      0));
+    return;
+  }
+  get_timespec_from_nanosec(abstime, get_nanosec_from_timespec(tss) +
+    get_nanosec_from_timespec(timeout));
 }
 
-#ifdef ATBUILTIN_RWLOCK_WITHOUT_SPIN_LOCK
-static inline int atbuiltin_spin_timedlock(atbuiltin_rwlock_t *lock, const struct timespec *timeout)
+static inline bool atbuiltin_deadline_passed(const struct timespec *abstime)
 {
-  int res;
-  if ((res = pthread_mutex_timedlock(&lock->mutex, timeout)))
-  {
-    return res;
-  }
-  return 0;
+  struct timespec tsc;
+  clock_gettime(CLOCK_MONOTONIC, &tsc);
+  return get_nanosec_from_timespec(&tsc) >= get_nanosec_from_timespec(abstime);
 }
 
-static inline void atbuiltin_spin_lock(atbuiltin_rwlock_t *lock)
+/*
+  A wait which timed out at an earlier deadline than abstime, such as
+  write_lock_interval, is not a timeout of the caller.
+*/
+static inline bool atbuiltin_wait_timed_out(int res, const struct timespec *ts, const struct timespec *abstime)
 {
-  pthread_mutex_lock(&lock->mutex);
+  return
+    res == ETIMEDOUT && abstime &&
+    (ts == abstime || atbuiltin_deadline_passed(abstime));
 }
-#else
-#define ATBUILTIN_RWLOCK_SPIN_LOOPS 7
-static inline int atbuiltin_spin_timedlock(atbuiltin_rwlock_t *lock, const struct timespec *timeout)
+
+/*
+  Returns the error with which a waiter gives up. A wait which ends by ts
+  before abstime, or by EAGAIN or EINTR, is retried. Other errors are
+  returned as they are, so that a waiter does not retry them forever.
+*/
+static inline int atbuiltin_wait_error(int res, const struct timespec *ts, const struct timespec *abstime)
 {
-  int res;
-  unsigned int i;
-  if (pthread_mutex_trylock(&lock->mutex))
+  if (res == ETIMEDOUT)
   {
-    for (i = 0; i < ATBUILTIN_RWLOCK_SPIN_LOOPS; i++)
-    {
-      if (!pthread_mutex_trylock(&lock->mutex))
-      {
-        break;
-      }
-    }
-    if (i == ATBUILTIN_RWLOCK_SPIN_LOOPS)
-    {
-      if ((res = pthread_mutex_timedlock(&lock->mutex, timeout)))
-      {
-        return res;
-      }
-    }
+    return atbuiltin_wait_timed_out(res, ts, abstime) ? ETIMEDOUT : 0;
   }
-  return 0;
+  if (res == EAGAIN || res == EINTR)
+  {
+    return 0;
+  }
+  return res;
 }
 
-static inline void atbuiltin_spin_lock(atbuiltin_rwlock_t *lock)
+/*
+  For waits which take only a deadline of CLOCK_REALTIME.
+*/
+static inline void atbuiltin_deadline_realtime(struct timespec *ts, const struct timespec *abstime)
 {
-  unsigned int i;
-  if (pthread_mutex_trylock(&lock->mutex))
+  struct timespec tsc;
+  unsigned long long int now;
+  clock_gettime(CLOCK_MONOTONIC, &tsc);
+  now = get_nanosec_from_timespec(&tsc);
+  clock_gettime(CLOCK_REALTIME, ts);
+  if (get_nanosec_from_timespec(abstime) > now)
   {
-    for (i = 0; i < ATBUILTIN_RWLOCK_SPIN_LOOPS; i++)
-    {
-      if (!pthread_mutex_trylock(&lock->mutex))
-      {
-        break;
-      }
-    }
-    if (i == ATBUILTIN_RWLOCK_SPIN_LOOPS)
-    {
-      pthread_mutex_lock(&lock->mutex);
-    }
+    get_timespec_from_nanosec(ts, get_nanosec_from_timespec(ts) +
+      get_nanosec_from_timespec(abstime) - now);
   }
 }
-#endif
 
-int atbuiltin_rwlockattr_init(atbuiltin_rwlock_attr_t *attr)
+/*
+  FUTEX_WAIT_BITSET takes an absolute deadline of CLOCK_MONOTONIC.
+*/
+static inline int atbuiltin_futex_wait(int *uaddr, int val, const struct timespec *abstime, int private_flag)
 {
-  int ret;
-  attr->rwlock_attr = ATBUILTIN_RWLOCK_READ_PRIORITY;
-  attr->write_lock_interval = 0;
-  if ((ret = pthread_condattr_init(&attr->cond_attr)))
-    goto error_condattr_init;
-  if ((ret = pthread_mutexattr_init(&attr->mutex_attr)))
-    goto error_mutexattr_init;
+  if (syscall(SYS_futex, uaddr, FUTEX_WAIT_BITSET | private_flag, val, abstime,
+    NULL, FUTEX_BITSET_MATCH_ANY))
+  {
+    return errno;
+  }
   return 0;
-
-error_mutexattr_init:
-  pthread_condattr_destroy(&attr->cond_attr);
-error_condattr_init:
-  return ret;
 }
 
-int atbuiltin_rwlockattr_destroy(atbuiltin_rwlock_attr_t *attr)
+static inline void atbuiltin_futex_wake(int *uaddr, int nr, int private_flag)
 {
-  int ret1, ret2;
-  ret1 = pthread_condattr_destroy(&attr->cond_attr);
-  ret2 = pthread_mutexattr_destroy(&attr->mutex_attr);
-  if (ret1)
-    return ret1;
-  return ret2;
+  syscall(SYS_futex, uaddr, FUTEX_WAKE | private_flag, nr, NULL, NULL, 0);
 }
 
-int atbuiltin_rwlockattr_setpshared_cond(atbuiltin_rwlock_attr_t *attr, int pshared)
+/*
+  futex_shared is 0 for the default of process private futexes, so that a
+  zeroed lock uses them too.
+*/
+static inline int atbuiltin_futex_flag(atbuiltin_rwlock_t *lock)
 {
-  return pthread_condattr_setpshared(&attr->cond_attr, pshared);
+  return lock->futex_shared ? 0 : FUTEX_PRIVATE_FLAG;
 }
 
-int atbuiltin_rwlockattr_getpshared_cond(atbuiltin_rwlock_attr_t *attr, int *pshared)
+/*
+  futex_mutex: 0 is unlocked, 1 is locked, 2 is locked and has waiters.
+  Local locks of cohort nodes work in the same way.
+*/
+static inline int atbuiltin_futex_mutex_trylock(int *mutex)
 {
-  return pthread_condattr_getpshared(&attr->cond_attr, pshared);
+  int zero_val = 0;
+  if (atbuiltin_compare_and_swap_n(mutex, &zero_val, 1,
+    ATBUILTIN_RWLOCK_CAS_WEAK, ATBUILTIN_RWLOCK_ACQUIRE,
+    ATBUILTIN_RWLOCK_RELAXED))
+  {
+    return 0;
+  }
+  return EBUSY;
 }
 
-int atbuiltin_rwlockattr_settype_mutex(atbuiltin_rwlock_attr_t *attr, int kind)
+static inline int atbuiltin_futex_mutex_timedlock(int *mutex, const struct timespec *abstime, int private_flag)
 {
-  return pthread_mutexattr_settype(&attr->mutex_attr, kind);
+  int res;
+  if (!atbuiltin_futex_mutex_trylock(mutex))
+  {
+    return 0;
+  }
+  while (atbuiltin_exchange_n(mutex, 2, ATBUILTIN_RWLOCK_ACQUIRE))
+  {
+    res = atbuiltin_futex_wait(mutex, 2, abstime, private_flag);
+    if (res == ETIMEDOUT)
+    {
+      return ETIMEDOUT;
+    }
+  }
+  return 0;
 }
 
-int atbuiltin_rwlockattr_gettype_mutex(atbuiltin_rwlock_attr_t *attr, int *kind)
+static inline void atbuiltin_futex_mutex_unlock(int *mutex, int private_flag)
 {
-  return pthread_mutexattr_gettype(&attr->mutex_attr, kind);
+  if (atbuiltin_exchange_n(mutex, 0, ATBUILTIN_RWLOCK_RELEASE) == 2)
+  {
+    atbuiltin_futex_wake(mutex, 1, private_flag);
+  }
 }
 
-int atbuiltin_rwlockattr_settype_priority(atbuiltin_rwlock_attr_t *attr, int priority)
+/*
+  With ATBUILTIN_RWLOCK_WAIT_PI, futex_mutex and write_owner hold the TID of
+  the thread which owns them, and waiters take them with FUTEX_LOCK_PI so that
+  the kernel lends the priority of the waiters to the owner. The kernel sets
+  FUTEX_WAITERS in the word while someone waits, and then the owner has to
+  release it with FUTEX_UNLOCK_PI.
+*/
+static __thread int atbuiltin_tid = 0;
+
+static inline int atbuiltin_gettid(void)
 {
-  switch (priority)
+  if (!atbuiltin_tid)
   {
-    case ATBUILTIN_RWLOCK_READ_PRIORITY:
-    case ATBUILTIN_RWLOCK_NO_PRIORITY:
-    case ATBUILTIN_RWLOCK_WRITE_PRIORITY:
-      break;
-    default:
-      return EINVAL;
+    atbuiltin_tid = (int) syscall(SYS_gettid);
   }
-  attr->rwlock_attr = priority;
-  return 0;
+  return atbuiltin_tid;
 }
 
-int atbuiltin_rwlockattr_gettype_priority(atbuiltin_rwlock_attr_t *attr, int *priority)
+static inline int atbuiltin_pi_mutex_trylock(int *mutex)
 {
-  *priority = attr->rwlock_attr;
-  return 0;
+  int zero_val = 0;
+  if (atbuiltin_compare_and_swap_n(mutex, &zero_val, atbuiltin_gettid(),
+    false, ATBUILTIN_RWLOCK_ACQUIRE, ATBUILTIN_RWLOCK_RELAXED))
+  {
+    return 0;
+  }
+  return EBUSY;
 }
 
-int atbuiltin_rwlockattr_settype_write_lock_interval(atbuiltin_rwlock_attr_t *attr, unsigned long long int interval)
+/*
+  FUTEX_LOCK_PI takes an absolute deadline of CLOCK_REALTIME.
+*/
+static inline int atbuiltin_pi_mutex_timedlock(int *mutex, const struct timespec *abstime, int private_flag)
 {
-  attr->write_lock_interval = interval;
+  struct timespec ts;
+  if (!atbuiltin_pi_mutex_trylock(mutex))
+  {
+    return 0;
+  }
+  if (abstime)
+  {
+    atbuiltin_deadline_realtime(&ts, abstime);
+  }
+  while (syscall(SYS_futex, mutex, FUTEX_LOCK_PI | private_flag, 0,
+    abstime ? &ts : NULL, NULL, 0))
+  {
+    if (errno != EINTR)
+    {
+      return errno;
+    }
+  }
   return 0;
 }
 
-int atbuiltin_rwlockattr_gettype_write_lock_interval(atbuiltin_rwlock_attr_t *attr, unsigned long long int *interval)
+static inline void atbuiltin_pi_mutex_unlock(int *mutex, int private_flag)
 {
-  *interval = attr->write_lock_interval;
-  return 0;
+  int tid = atbuiltin_gettid();
+  if (!atbuiltin_compare_and_swap_n(mutex, &tid, 0, false,
+    ATBUILTIN_RWLOCK_RELEASE, ATBUILTIN_RWLOCK_RELAXED))
+  {
+    syscall(SYS_futex, mutex, FUTEX_UNLOCK_PI | private_flag, 0, NULL, NULL,
+      0);
+  }
 }
 
-int atbuiltin_rwlock_init(atbuiltin_rwlock_t *lock, const atbuiltin_rwlock_attr_t *attr)
+/*
+  FUTEX_UNLOCK_PI of a word which this thread does not own fails with EPERM
+  when the kernel supports PI futexes, and with ENOSYS when it does not.
+*/
+static inline int atbuiltin_pi_supported(void)
 {
-  int ret;
-  lock->lock_body = 0;
-  lock->writer_count = 0;
-  lock->tr_waiter_count = 0;
-  lock->read_waiting = false;
-  lock->write_waiting = false;
-  if (attr)
-  {
-    lock->write_lock_interval = attr->write_lock_interval;
-    get_timespec_from_nanosec(&lock->write_lock_interval_ts, lock->write_lock_interval);
-    if (attr->rwlock_attr == ATBUILTIN_RWLOCK_READ_PRIORITY)
-    {
-      lock->timedrlock = atbuiltin_rwlock_timedrlock_read_priority;
-      lock->rlock = atbuiltin_rwlock_rlock_read_priority;
-      lock->timedwlock = atbuiltin_rwlock_timedwlock_read_priority;
-      lock->wlock = atbuiltin_rwlock_wlock_read_priority;
-      lock->wunlock = atbuiltin_rwlock_wunlock_read_priority;
-    } else {
-      if (attr->rwlock_attr == ATBUILTIN_RWLOCK_WRITE_PRIORITY)
-      {
-        lock->timedrlock = atbuiltin_rwlock_timedrlock_write_priority;
-        lock->rlock = atbuiltin_rwlock_rlock_write_priority;
-        lock->timedwlock = atbuiltin_rwlock_timedwlock_write_priority;
-        lock->wlock = atbuiltin_rwlock_wlock_write_priority;
-        lock->wunlock = atbuiltin_rwlock_wunlock_write_priority;
-      } else {
-        lock->timedrlock = atbuiltin_rwlock_timedrlock_no_priority;
-        lock->rlock = atbuiltin_rwlock_rlock_no_priority;
-        lock->timedwlock = atbuiltin_rwlock_timedwlock_no_priority;
-        lock->wlock = atbuiltin_rwlock_wlock_no_priority;
-        lock->wunlock = atbuiltin_rwlock_wunlock_no_priority;
-      }
-    }
-    if ((ret = pthread_cond_init(&lock->cond, &attr->cond_attr)))
-      goto error_cond_init;
-    if ((ret = pthread_mutex_init(&lock->mutex, &attr->mutex_attr)))
-      goto error_mutex_init;
-  } else {
-    lock->write_lock_interval = 0;
-    get_timespec_from_nanosec(&lock->write_lock_interval_ts, lock->write_lock_interval);
-    lock->timedrlock = atbuiltin_rwlock_timedrlock_read_priority;
-    lock->rlock = atbuiltin_rwlock_rlock_read_priority;
-    lock->timedwlock = atbuiltin_rwlock_timedwlock_read_priority;
-    lock->wlock = atbuiltin_rwlock_wlock_read_priority;
-    lock->wunlock = atbuiltin_rwlock_wunlock_read_priority;
-    if ((ret = pthread_cond_init(&lock->cond, NULL)))
-      goto error_cond_init;
-    if ((ret = pthread_mutex_init(&lock->mutex, NULL)))
-      goto error_mutex_init;
+  int word = 0;
+  if (
+    syscall(SYS_futex, &word, FUTEX_UNLOCK_PI | FUTEX_PRIVATE_FLAG, 0, NULL,
+      NULL, 0) &&
+    errno == ENOSYS
+  ) {
+    return ENOSYS;
   }
   return 0;
+}
 
-error_mutex_init:
-  pthread_cond_destroy(&lock->cond);
-error_cond_init:
-  return ret;
+/*
+  pthread_mutex_timedlock and pthread_cond_timedwait take a deadline of
+  CLOCK_REALTIME. Since glibc 2.30, the deadline of CLOCK_MONOTONIC is given
+  to pthread_mutex_clocklock and pthread_cond_clockwait as it is.
+*/
+static inline int atbuiltin_pthread_mutex_timedlock(pthread_mutex_t *mutex, const struct timespec *abstime)
+{
+#ifdef ATBUILTIN_RWLOCK_HAVE_CLOCKWAIT
+  return pthread_mutex_clocklock(mutex, CLOCK_MONOTONIC, abstime);
+#else
+  struct timespec ts;
+  atbuiltin_deadline_realtime(&ts, abstime);
+  return pthread_mutex_timedlock(mutex, &ts);
+#endif
 }
 
-int atbuiltin_rwlock_destroy(atbuiltin_rwlock_t *lock)
+static inline int atbuiltin_pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime)
 {
-  int ret1, ret2;
-  ret1 = pthread_cond_destroy(&lock->cond);
-  ret2 = pthread_mutex_destroy(&lock->mutex);
-  if (ret1)
-    return ret1;
-  return ret2;
+#ifdef ATBUILTIN_RWLOCK_HAVE_CLOCKWAIT
+  return pthread_cond_clockwait(cond, mutex, CLOCK_MONOTONIC, abstime);
+#else
+  struct timespec ts;
+  atbuiltin_deadline_realtime(&ts, abstime);
+  return pthread_cond_timedwait(cond, mutex, &ts);
+#endif
 }
 
-int atbuiltin_rwlock_tryrlock(atbuiltin_rwlock_t *lock)
+/*
+  A lock from ATBUILTIN_RWLOCK_INITIALIZER or from atbuiltin_rwlock_init
+  without attr initializes mutex, cond_mutex and cond when a thread uses them
+  first, which is only when the lock is contended. Both the waiter and the
+  waker call atbuiltin_wait_setup before they use them, so whichever comes
+  first initializes them, and the other waits for wait_setup to be done.
+  Initializing them without attributes does not fail.
+*/
+#define ATBUILTIN_RWLOCK_WAIT_SETUP_NONE    0
+#define ATBUILTIN_RWLOCK_WAIT_SETUP_RUNNING 1
+#define ATBUILTIN_RWLOCK_WAIT_SETUP_DONE    2
+static void atbuiltin_wait_setup_slow(atbuiltin_rwlock_t *lock)
 {
-  int res;
-  atbuiltin_rwlock_signed cnt;
-  if (lock->write_waiting)
+  int state = ATBUILTIN_RWLOCK_WAIT_SETUP_NONE;
+  if (atbuiltin_compare_and_swap_n(&lock->wait_setup, &state,
+    ATBUILTIN_RWLOCK_WAIT_SETUP_RUNNING, false, ATBUILTIN_RWLOCK_ACQUIRE,
+    ATBUILTIN_RWLOCK_ACQUIRE))
   {
-    return EBUSY;
+    pthread_mutex_init(&lock->mutex, NULL);
+    pthread_mutex_init(&lock->cond_mutex, NULL);
+    pthread_cond_init(&lock->cond, NULL);
+    atbuiltin_store_n(&lock->wait_setup, ATBUILTIN_RWLOCK_WAIT_SETUP_DONE,
+      ATBUILTIN_RWLOCK_RELEASE);
+    return;
   }
-  cnt = atbuiltin_add_and_fetch(&lock->lock_body, 1, ATBUILTIN_RWLOCK_ACQUIRE);
-  if (cnt > 0)
-  {
-    /* lock success */
-    return 0;
+  while (
+    atbuiltin_load_n(&lock->wait_setup, ATBUILTIN_RWLOCK_ACQUIRE) !=
+      ATBUILTIN_RWLOCK_WAIT_SETUP_DONE
+  ) {
+    sched_yield();
   }
-  atbuiltin_sub_and_fetch(&lock->lock_body, 1, ATBUILTIN_RWLOCK_RELAXED);
-  return EBUSY;
 }
 
-/*
-int atbuiltin_rwlock_timedrlock(atbuiltin_rwlock_t *lock, const struct timespec *timeout)
+static inline void atbuiltin_wait_setup(atbuiltin_rwlock_t *lock)
 {
-  return lock->timedrlock(lock, timeout);
+  if (
+    atbuiltin_load_n(&lock->wait_setup, ATBUILTIN_RWLOCK_ACQUIRE) !=
+      ATBUILTIN_RWLOCK_WAIT_SETUP_DONE
+  ) {
+    atbuiltin_wait_setup_slow(lock);
+  }
 }
 
-int atbuiltin_rwlock_rlock(atbuiltin_rwlock_t *lock)
+static inline int atbuiltin_mutex_trylock(atbuiltin_rwlock_t *lock)
 {
-  return lock->rlock(lock);
+  if (lock->wait_type == ATBUILTIN_RWLOCK_WAIT_PI)
+  {
+    return atbuiltin_pi_mutex_trylock(&lock->futex_mutex);
+  }
+  if (lock->wait_type != ATBUILTIN_RWLOCK_WAIT_PTHREAD)
+  {
+    return atbuiltin_futex_mutex_trylock(&lock->futex_mutex);
+  }
+  atbuiltin_wait_setup(lock);
+  return pthread_mutex_trylock(&lock->mutex);
 }
-*/
 
-int atbuiltin_rwlock_runlock(atbuiltin_rwlock_t *lock)
+static inline int atbuiltin_mutex_timedlock(atbuiltin_rwlock_t *lock, const struct timespec *abstime)
 {
-  atbuiltin_sub_and_fetch(&lock->lock_body, 1, ATBUILTIN_RWLOCK_RELEASE);
-  return 0;
+  if (lock->wait_type == ATBUILTIN_RWLOCK_WAIT_SPIN)
+  {
+    return atbuiltin_busy_mutex_timedlock(lock, abstime);
+  }
+  if (lock->wait_type == ATBUILTIN_RWLOCK_WAIT_PI)
+  {
+    return atbuiltin_pi_mutex_timedlock(&lock->futex_mutex, abstime,
+      atbuiltin_futex_flag(lock));
+  }
+  if (lock->wait_type != ATBUILTIN_RWLOCK_WAIT_PTHREAD)
+  {
+    return atbuiltin_futex_mutex_timedlock(&lock->futex_mutex, abstime,
+      atbuiltin_futex_flag(lock));
+  }
+  atbuiltin_wait_setup(lock);
+  return atbuiltin_pthread_mutex_timedlock(&lock->mutex, abstime);
 }
 
-int atbuiltin_rwlock_trywlock(atbuiltin_rwlock_t *lock)
+static inline void atbuiltin_mutex_lock(atbuiltin_rwlock_t *lock)
 {
-  int ret;
-  if ((ret = pthread_mutex_trylock(&lock->mutex)))
-    return ret;
-  if (lock->write_waiting)
+  if (lock->wait_type == ATBUILTIN_RWLOCK_WAIT_SPIN)
   {
-    atbuiltin_add_and_fetch(&lock->writer_count, 1, ATBUILTIN_RWLOCK_RELAXED);
-    /* lock success */
-    return 0;
+    atbuiltin_busy_mutex_timedlock(lock, NULL);
+    return;
   }
-  register atbuiltin_rwlock_signed zero_val = 0;
-  if (atbuiltin_compare_and_swap_n(&lock->lock_body, &zero_val,
-    ATBUILTIN_RWLOCK_MIN_VAL, ATBUILTIN_RWLOCK_CAS_WEAK,
-    ATBUILTIN_RWLOCK_ACQUIRE, ATBUILTIN_RWLOCK_RELAXED))
+  if (lock->wait_type == ATBUILTIN_RWLOCK_WAIT_PI)
   {
-    atbuiltin_add_and_fetch(&lock->writer_count, 1, ATBUILTIN_RWLOCK_RELAXED);
-    lock->write_waiting = true;
-    /* lock success */
-    return 0;
+    atbuiltin_pi_mutex_timedlock(&lock->futex_mutex, NULL,
+      atbuiltin_futex_flag(lock));
+    return;
+  }
+  if (lock->wait_type != ATBUILTIN_RWLOCK_WAIT_PTHREAD)
+  {
+    atbuiltin_futex_mutex_timedlock(&lock->futex_mutex, NULL,
+      atbuiltin_futex_flag(lock));
+    return;
+  }
+  atbuiltin_wait_setup(lock);
+  pthread_mutex_lock(&lock->mutex);
+}
+
+static inline void atbuiltin_mutex_unlock(atbuiltin_rwlock_t *lock)
+{
+  if (lock->wait_type == ATBUILTIN_RWLOCK_WAIT_PI)
+  {
+    atbuiltin_pi_mutex_unlock(&lock->futex_mutex, atbuiltin_futex_flag(lock));
+    return;
+  }
+  if (lock->wait_type != ATBUILTIN_RWLOCK_WAIT_PTHREAD)
+  {
+    atbuiltin_futex_mutex_unlock(&lock->futex_mutex, atbuiltin_futex_flag(lock));
+    return;
   }
   pthread_mutex_unlock(&lock->mutex);
-  return EBUSY;
 }
 
-/*
-int atbuiltin_rwlock_timedwlock(atbuiltin_rwlock_t *lock, const struct timespec *timeout)
+static inline bool atbuiltin_rwlock_read_blocked(atbuiltin_rwlock_state state)
 {
-  return lock->timedwlock(lock, timeout);
+  return state & (ATBUILTIN_RWLOCK_WRITE_LOCKED | ATBUILTIN_RWLOCK_WRITE_WAITING);
 }
 
-int atbuiltin_rwlock_wlock(atbuiltin_rwlock_t *lock)
+/*
+  With read_max, no more readers than that are counted in lock_body. A reader
+  which would go over it fails or waits in the same way as a reader blocked
+  by a writer. read_max may be changed while the lock is used.
+*/
+static inline bool atbuiltin_rwlock_read_full(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_state state)
 {
-  return lock->wlock(lock);
+  unsigned int max = atbuiltin_load_n(&lock->read_max,
+    ATBUILTIN_RWLOCK_RELAXED);
+  return max && (state & ATBUILTIN_RWLOCK_READER_MASK) >= max;
 }
 
-int atbuiltin_rwlock_wunlock(atbuiltin_rwlock_t *lock)
+/*
+  A waiting reader keeps READ_PHASE of the state in which it was counted as a
+  waiter. If it is flipped, a writer has already given the lock to the reader.
+*/
+static inline bool atbuiltin_rwlock_read_waits(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_state state, atbuiltin_rwlock_state phase)
 {
-  return lock->wunlock(lock);
+  return
+    (
+      atbuiltin_rwlock_read_blocked(state) ||
+      atbuiltin_rwlock_read_full(lock, state)
+    ) &&
+    (state & ATBUILTIN_RWLOCK_READ_PHASE) == phase;
 }
+
+/*
+  With per-CPU read counters, readers count themselves in read_slots instead
+  of lock_body, so the reader count in lock_body stays 0. A reader may leave
+  on another CPU than it entered, so only the sum of all slots means the
+  number of readers. Writers set WRITE_WAITING before they read the slots, so
+  a reader which enters after that sees it and leaves again.
 */
+static inline bool atbuiltin_read_slots_busy(atbuiltin_rwlock_t *lock)
+{
+  int i;
+  long long int readers = 0;
+  atbuiltin_thread_fence(ATBUILTIN_RWLOCK_SEQ_CST);
+  for (i = 0; i < lock->read_slot_count; i++)
+  {
+    readers += atbuiltin_load_n(&lock->read_slots[i].readers,
+      ATBUILTIN_RWLOCK_SEQ_CST);
+  }
+  return readers != 0;
+}
 
-static int atbuiltin_rwlock_timedrlock_read_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout)
+static inline bool atbuiltin_rwlock_drain_busy(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_state state)
 {
-  int res;
-  atbuiltin_rwlock_signed cnt;
-  struct timespec tss, tsc, tsr;
-  tsr = *timeout;
-  clock_gettime(CLOCK_MONOTONIC, &tss);
-  atbuiltin_add_and_fetch(&lock->tr_waiter_count, 1, ATBUILTIN_RWLOCK_RELAXED);
-  if (lock->write_waiting)
+  if (state & (ATBUILTIN_RWLOCK_READER_MASK | ATBUILTIN_RWLOCK_WRITE_LOCKED))
   {
-    clock_gettime(CLOCK_MONOTONIC, &tsc);
-    if (timespec_sub(&tsr, &tss, &tsc))
+    return true;
+  }
+  return
+    lock->read_counter_type == ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU &&
+    atbuiltin_read_slots_busy(lock);
+}
+
+/*
+  Readers which wait for a writer are counted in lock_body and sleep on
+  futex_read_seq without touching futex_mutex. The writer which clears the
+  write bits sees that count in the same CAS and wakes them all together.
+  Writers queue on futex_mutex, so each unlock wakes exactly one writer.
+  With ATBUILTIN_RWLOCK_WAIT_PI, one of the readers which wait for the writer
+  holding the lock becomes pi_waiter and takes and releases write_owner
+  instead, which lends its priority to that writer. Since the kernel hands
+  write_owner to one waiter at a time, the other readers still sleep on
+  futex_read_seq and are woken together after the writer clears the write
+  bits, instead of passing write_owner on one after another.
+  Errors other than a timeout of the wait are returned to the reader.
+*/
+static inline int atbuiltin_futex_wait_writer(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_state phase, const struct timespec *abstime)
+{
+  int res = 0, seq;
+  atbuiltin_rwlock_state state;
+  seq = atbuiltin_load_n(&lock->futex_read_seq, ATBUILTIN_RWLOCK_ACQUIRE);
+  state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_ACQUIRE);
+  if (!atbuiltin_rwlock_read_waits(lock, state, phase))
+  {
+    return 0;
+  }
+  if (
+    lock->wait_type == ATBUILTIN_RWLOCK_WAIT_PI &&
+    (state & ATBUILTIN_RWLOCK_WRITE_LOCKED) &&
+    atbuiltin_load_n(&lock->write_owner, ATBUILTIN_RWLOCK_RELAXED) &&
+    !atbuiltin_load_n(&lock->pi_waiter, ATBUILTIN_RWLOCK_RELAXED) &&
+    !atbuiltin_exchange_n(&lock->pi_waiter, 1, ATBUILTIN_RWLOCK_ACQUIRE)
+  ) {
+    if (!(res = atbuiltin_pi_mutex_timedlock(&lock->write_owner, abstime,
+      atbuiltin_futex_flag(lock))))
+    {
+      atbuiltin_pi_mutex_unlock(&lock->write_owner, atbuiltin_futex_flag(lock));
+    }
+    atbuiltin_store_n(&lock->pi_waiter, 0, ATBUILTIN_RWLOCK_RELEASE);
+    return res;
+  }
+  res = atbuiltin_futex_wait(&lock->futex_read_seq, seq, abstime,
+    atbuiltin_futex_flag(lock));
+  return res == EAGAIN || res == EINTR ? 0 : res;
+}
+
+static inline int atbuiltin_wait_writer(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_state phase)
+{
+  if (
+    lock->wait_type == ATBUILTIN_RWLOCK_WAIT_FUTEX ||
+    lock->wait_type == ATBUILTIN_RWLOCK_WAIT_PI
+  ) {
+    return atbuiltin_futex_wait_writer(lock, phase, NULL);
+  }
+  atbuiltin_wait_setup(lock);
+  pthread_mutex_lock(&lock->cond_mutex);
+  if (atbuiltin_rwlock_read_waits(lock,
+    atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED), phase))
+  {
+    pthread_cond_wait(&lock->cond, &lock->cond_mutex);
+  }
+  pthread_mutex_unlock(&lock->cond_mutex);
+  return 0;
+}
+
+static inline int atbuiltin_timedwait_writer(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_state phase, const struct timespec *abstime)
+{
+  int res;
+  if (
+    lock->wait_type == ATBUILTIN_RWLOCK_WAIT_FUTEX ||
+    lock->wait_type == ATBUILTIN_RWLOCK_WAIT_PI
+  ) {
+    return atbuiltin_futex_wait_writer(lock, phase, abstime);
+  }
+  atbuiltin_wait_setup(lock);
+  if ((res = atbuiltin_pthread_mutex_timedlock(&lock->cond_mutex, abstime)))
+  {
+    return res;
+  }
+  if (atbuiltin_rwlock_read_waits(lock,
+    atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED), phase))
+  {
+    if ((res = atbuiltin_pthread_cond_timedwait(&lock->cond,
+      &lock->cond_mutex, abstime)))
+    {
+      if (res == ETIMEDOUT)
+      {
+        pthread_mutex_unlock(&lock->cond_mutex);
+        return ETIMEDOUT;
+      }
+    }
+  }
+  pthread_mutex_unlock(&lock->cond_mutex);
+  return 0;
+}
+
+static inline void atbuiltin_wake_readers(atbuiltin_rwlock_t *lock)
+{
+  if (lock->wait_type == ATBUILTIN_RWLOCK_WAIT_SPIN)
+  {
+    return;
+  }
+  if (
+    lock->wait_type == ATBUILTIN_RWLOCK_WAIT_FUTEX ||
+    lock->wait_type == ATBUILTIN_RWLOCK_WAIT_PI
+  ) {
+    atbuiltin_add_and_fetch(&lock->futex_read_seq, 1,
+      ATBUILTIN_RWLOCK_RELEASE);
+    atbuiltin_futex_wake(&lock->futex_read_seq, INT_MAX,
+      atbuiltin_futex_flag(lock));
+    return;
+  }
+  /*
+    Writers do not hold cond_mutex when they unlock. Taking it once makes sure
+    that a reader which saw the write bits is already in pthread_cond_wait.
+  */
+  atbuiltin_wait_setup(lock);
+  pthread_mutex_lock(&lock->cond_mutex);
+  pthread_mutex_unlock(&lock->cond_mutex);
+  pthread_cond_broadcast(&lock->cond);
+}
+
+/*
+  A writer which holds the mutex and waits for readers or the writer which
+  holds the lock to leave sets drain_waiting and sleeps on it. The reader which
+  brings the reader count in lock_body down to 0, or the writer which unlocks
+  while other writers wait, clears it and wakes that writer. With per-CPU read
+  counters, every reader which leaves wakes that writer to sum the slots.
+  With ATBUILTIN_RWLOCK_WAIT_PI, a writer which waits for the writer holding
+  the lock takes and releases write_owner like pi_waiter does. Only the
+  writer which holds the mutex waits here, so at most two threads ever wait
+  on write_owner.
+*/
+static inline int atbuiltin_wait_readers(atbuiltin_rwlock_t *lock, const struct timespec *abstime)
+{
+  int res = 0;
+  if (
+    lock->wait_type == ATBUILTIN_RWLOCK_WAIT_PI &&
+    (atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED) &
+      ATBUILTIN_RWLOCK_WRITE_LOCKED) &&
+    atbuiltin_load_n(&lock->write_owner, ATBUILTIN_RWLOCK_RELAXED)
+  ) {
+    if (!(res = atbuiltin_pi_mutex_timedlock(&lock->write_owner, abstime,
+      atbuiltin_futex_flag(lock))))
+    {
+      atbuiltin_pi_mutex_unlock(&lock->write_owner, atbuiltin_futex_flag(lock));
+    }
+    return res;
+  }
+  atbuiltin_exchange_n(&lock->drain_waiting, 1, ATBUILTIN_RWLOCK_SEQ_CST);
+  if (atbuiltin_rwlock_drain_busy(lock,
+    atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_SEQ_CST)))
+  {
+    res = atbuiltin_futex_wait(&lock->drain_waiting, 1, abstime,
+      atbuiltin_futex_flag(lock));
+  }
+  atbuiltin_exchange_n(&lock->drain_waiting, 0, ATBUILTIN_RWLOCK_RELAXED);
+  return res;
+}
+
+static inline void atbuiltin_wake_drain_writer(atbuiltin_rwlock_t *lock)
+{
+  if (
+    atbuiltin_load_n(&lock->drain_waiting, ATBUILTIN_RWLOCK_SEQ_CST) &&
+    atbuiltin_exchange_n(&lock->drain_waiting, 0, ATBUILTIN_RWLOCK_RELAXED)
+  ) {
+    atbuiltin_futex_wake(&lock->drain_waiting, 1, atbuiltin_futex_flag(lock));
+  }
+}
+
+static inline int atbuiltin_numa_node(void)
+{
+  unsigned int cpu, node;
+  if (getcpu(&cpu, &node))
+    return 0;
+  return (int) node;
+}
+
+/*
+  With the NUMA cohort, read_slots has one slot for each node instead of each
+  CPU.
+*/
+static inline atbuiltin_rwlock_read_slot_t *atbuiltin_read_slot(atbuiltin_rwlock_t *lock)
+{
+  int cpu;
+  if (lock->cohort_type == ATBUILTIN_RWLOCK_COHORT_NUMA)
+  {
+    return &lock->read_slots[atbuiltin_numa_node() % lock->read_slot_count];
+  }
+  cpu = sched_getcpu();
+  return &lock->read_slots[cpu < 0 ? 0 : cpu % lock->read_slot_count];
+}
+
+static inline void atbuiltin_read_slot_exit(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_read_slot_t *slot)
+{
+  atbuiltin_sub_and_fetch(&slot->readers, 1, ATBUILTIN_RWLOCK_SEQ_CST);
+  atbuiltin_wake_drain_writer(lock);
+}
+
+static inline int atbuiltin_read_slot_trylock(atbuiltin_rwlock_t *lock)
+{
+  atbuiltin_rwlock_read_slot_t *slot = atbuiltin_read_slot(lock);
+  atbuiltin_add_and_fetch(&slot->readers, 1, ATBUILTIN_RWLOCK_SEQ_CST);
+  if (!atbuiltin_rwlock_read_blocked(
+    atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_SEQ_CST)))
+  {
+    /* lock success */
+    return 0;
+  }
+  atbuiltin_read_slot_exit(lock, slot);
+  return EBUSY;
+}
+
+/*
+  Reader bias. While read_bias is set, a reader publishes the lock into a
+  slot of atbuiltin_visible_readers hashed by the lock and the thread, and
+  does not touch the lock itself. A writer takes the lock as usual, clears
+  read_bias, and waits until no slot points at the lock. read_bias is set
+  again by a reader after BIAS_INHIBIT_MULTIPLIER times of the time which the
+  last revocation took, so that write-heavy locks do not revoke too often.
+  Each thread remembers the slots it holds to release them. While read_bias
+  is clear, each thread checks the deadline only every
+  ATBUILTIN_RWLOCK_BIAS_CHECK acquisitions of the lock, counted in slots
+  hashed by the lock, so that readers do not read the clock each time.
+*/
+#define ATBUILTIN_RWLOCK_VISIBLE_READERS_BITS 12
+#define ATBUILTIN_RWLOCK_VISIBLE_READERS \
+  (1 << ATBUILTIN_RWLOCK_VISIBLE_READERS_BITS)
+#define ATBUILTIN_RWLOCK_BIAS_HELD 8
+#define ATBUILTIN_RWLOCK_BIAS_INHIBIT_MULTIPLIER 9
+#define ATBUILTIN_RWLOCK_BIAS_CHECK 64
+#define ATBUILTIN_RWLOCK_BIAS_TICKS_BITS 4
+#define ATBUILTIN_RWLOCK_BIAS_TICKS (1 << ATBUILTIN_RWLOCK_BIAS_TICKS_BITS)
+struct atbuiltin_bias_held_t
+{
+  atbuiltin_rwlock_t *lock;
+  atbuiltin_rwlock_t **slot;
+};
+struct atbuiltin_bias_tick_t
+{
+  atbuiltin_rwlock_t *lock;
+  unsigned int tick;
+};
+static atbuiltin_rwlock_t *atbuiltin_visible_readers[
+  ATBUILTIN_RWLOCK_VISIBLE_READERS];
+static __thread atbuiltin_bias_held_t atbuiltin_bias_held[
+  ATBUILTIN_RWLOCK_BIAS_HELD];
+static __thread atbuiltin_bias_tick_t atbuiltin_bias_ticks[
+  ATBUILTIN_RWLOCK_BIAS_TICKS];
+
+static inline atbuiltin_rwlock_t **atbuiltin_bias_slot(atbuiltin_rwlock_t *lock)
+{
+  unsigned long long int hash = (unsigned long long int)
+    ((unsigned long) lock ^ (unsigned long) atbuiltin_bias_held);
+  hash = (hash ^ (hash >> 29)) * 0x9E3779B97F4A7C15ULL;
+  return &atbuiltin_visible_readers[
+    hash >> (64 - ATBUILTIN_RWLOCK_VISIBLE_READERS_BITS)];
+}
+
+static inline int atbuiltin_bias_read_trylock(atbuiltin_rwlock_t *lock)
+{
+  int i;
+  atbuiltin_rwlock_t **slot, *empty = NULL;
+  for (i = 0; i < ATBUILTIN_RWLOCK_BIAS_HELD; i++)
+  {
+    if (!atbuiltin_bias_held[i].lock)
+      break;
+  }
+  if (i == ATBUILTIN_RWLOCK_BIAS_HELD)
+  {
+    return EBUSY;
+  }
+  slot = atbuiltin_bias_slot(lock);
+  if (
+    atbuiltin_load_n(slot, ATBUILTIN_RWLOCK_RELAXED) ||
+    !atbuiltin_compare_and_swap_n(slot, &empty, lock,
+      ATBUILTIN_RWLOCK_CAS_WEAK, ATBUILTIN_RWLOCK_SEQ_CST,
+      ATBUILTIN_RWLOCK_RELAXED)
+  ) {
+    return EBUSY;
+  }
+  if (atbuiltin_load_n(&lock->read_bias, ATBUILTIN_RWLOCK_SEQ_CST))
+  {
+    atbuiltin_bias_held[i].lock = lock;
+    atbuiltin_bias_held[i].slot = slot;
+    /* lock success */
+    return 0;
+  }
+  atbuiltin_store_n(slot, NULL, ATBUILTIN_RWLOCK_RELEASE);
+  return EBUSY;
+}
+
+static inline bool atbuiltin_bias_read_exit(atbuiltin_rwlock_t *lock)
+{
+  int i;
+  for (i = 0; i < ATBUILTIN_RWLOCK_BIAS_HELD; i++)
+  {
+    if (atbuiltin_bias_held[i].lock == lock)
+    {
+      atbuiltin_store_n(atbuiltin_bias_held[i].slot, NULL,
+        ATBUILTIN_RWLOCK_RELEASE);
+      atbuiltin_bias_held[i].lock = NULL;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Called by a reader which holds the lock without bias. */
+static inline void atbuiltin_bias_update(atbuiltin_rwlock_t *lock)
+{
+  struct timespec tsc;
+  atbuiltin_bias_tick_t *tick;
+  if (
+    lock->bias_type != ATBUILTIN_RWLOCK_BIAS_READ ||
+    atbuiltin_load_n(&lock->read_bias, ATBUILTIN_RWLOCK_RELAXED)
+  ) {
+    return;
+  }
+  tick = &atbuiltin_bias_ticks[
+    ((unsigned long long int) (unsigned long) lock * 0x9E3779B97F4A7C15ULL) >>
+    (64 - ATBUILTIN_RWLOCK_BIAS_TICKS_BITS)];
+  if (tick->lock != lock)
+  {
+    tick->lock = lock;
+    tick->tick = 0;
+  }
+  if (++tick->tick % ATBUILTIN_RWLOCK_BIAS_CHECK)
+  {
+    return;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &tsc);
+  if (get_nanosec_from_timespec(&tsc) >=
+    atbuiltin_load_n(&lock->bias_inhibit_until, ATBUILTIN_RWLOCK_RELAXED))
+  {
+    atbuiltin_store_n(&lock->read_bias, 1, ATBUILTIN_RWLOCK_RELAXED);
+  }
+}
+
+/*
+  The reader count goes down one at a time, so the reader which brings it to
+  read_max - 1 wakes the readers which wait for the limit.
+*/
+static inline void atbuiltin_read_body_exit(atbuiltin_rwlock_t *lock)
+{
+  unsigned int max;
+  atbuiltin_rwlock_state state = atbuiltin_sub_and_fetch(&lock->lock_body,
+    ATBUILTIN_RWLOCK_READER_ONE, ATBUILTIN_RWLOCK_SEQ_CST);
+  if (!(state & ATBUILTIN_RWLOCK_READER_MASK))
+  {
+    atbuiltin_wake_drain_writer(lock);
+  }
+  if (
+    (max = atbuiltin_load_n(&lock->read_max, ATBUILTIN_RWLOCK_RELAXED)) &&
+    (state & ATBUILTIN_RWLOCK_READER_MASK) == max - 1 &&
+    (state & ATBUILTIN_RWLOCK_READ_WAITER_MASK)
+  ) {
+    atbuiltin_wake_readers(lock);
+  }
+}
+
+static inline void atbuiltin_rwlock_read_exit(atbuiltin_rwlock_t *lock)
+{
+  if (
+    lock->bias_type == ATBUILTIN_RWLOCK_BIAS_READ &&
+    atbuiltin_bias_read_exit(lock)
+  ) {
+    return;
+  }
+  if (lock->read_counter_type == ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU)
+  {
+    atbuiltin_read_slot_exit(lock, atbuiltin_read_slot(lock));
+    return;
+  }
+  atbuiltin_read_body_exit(lock);
+}
+
+/*
+  The plain check keeps readers which would fail anyway from moving the reader
+  count while a writer waits for it to reach 0.
+*/
+static inline int atbuiltin_rwlock_read_trylock(atbuiltin_rwlock_t *lock)
+{
+  int res;
+  atbuiltin_rwlock_state state;
+  if (
+    atbuiltin_load_n(&lock->read_bias, ATBUILTIN_RWLOCK_RELAXED) &&
+    !atbuiltin_bias_read_trylock(lock)
+  ) {
+    /* lock success */
+    return 0;
+  }
+  state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED);
+  if (
+    atbuiltin_rwlock_read_blocked(state) ||
+    atbuiltin_rwlock_read_full(lock, state)
+  ) {
+    return EBUSY;
+  }
+  if (lock->read_counter_type == ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU)
+  {
+    res = atbuiltin_read_slot_trylock(lock);
+  } else {
+    state = atbuiltin_add_and_fetch(&lock->lock_body,
+      ATBUILTIN_RWLOCK_READER_ONE, ATBUILTIN_RWLOCK_ACQUIRE);
+    if (
+      !atbuiltin_rwlock_read_blocked(state) &&
+      !atbuiltin_rwlock_read_full(lock, state - ATBUILTIN_RWLOCK_READER_ONE)
+    ) {
+      res = 0;
+    } else {
+      atbuiltin_read_body_exit(lock);
+      res = EBUSY;
+    }
+  }
+  if (!res)
+  {
+    /* lock success */
+    atbuiltin_bias_update(lock);
+  }
+  return res;
+}
+
+static inline void atbuiltin_cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+  __asm__ __volatile__ ("pause" ::: "memory");
+#elif defined(__aarch64__)
+  __asm__ __volatile__ ("yield" ::: "memory");
+#else
+  __asm__ __volatile__ ("" ::: "memory");
+#endif
+}
+
+/*
+  Busy-poll wait type. Waiters never sleep nor yield the CPU, and call no
+  system call while they wait, so nobody needs to wake them either. Each wait
+  gives up with EBUSY after wait_spin_limit polls when it is not 0. A timed
+  wait checks the deadline at each poll.
+*/
+static inline int atbuiltin_busy_wait(atbuiltin_rwlock_t *lock, unsigned long long int *cnt, const struct timespec *abstime)
+{
+  if (lock->wait_spin_limit && ++*cnt > lock->wait_spin_limit)
+  {
+    return EBUSY;
+  }
+  if (abstime && atbuiltin_deadline_passed(abstime))
+  {
+    return ETIMEDOUT;
+  }
+  atbuiltin_cpu_relax();
+  return 0;
+}
+
+static inline int atbuiltin_busy_mutex_timedlock(atbuiltin_rwlock_t *lock, const struct timespec *abstime)
+{
+  int res;
+  unsigned long long int cnt = 0;
+  while (atbuiltin_futex_mutex_trylock(&lock->futex_mutex))
+  {
+    if ((res = atbuiltin_busy_wait(lock, &cnt, abstime)))
+    {
+      return res;
+    }
+  }
+  return 0;
+}
+
+/*
+  Adaptive spin budget: spin at most twice of the recent average plus some,
+  and move the average by 1/8 of the distance to the latest spin count.
+*/
+#define ATBUILTIN_RWLOCK_SPIN_LOOPS 7
+#define ATBUILTIN_RWLOCK_ADAPTIVE_SPIN_MAX 100
+static inline int atbuiltin_spin_max_count(int *spin_count)
+{
+  int max_cnt = atbuiltin_load_n(spin_count, ATBUILTIN_RWLOCK_RELAXED) * 2 +
+    10;
+  return max_cnt < ATBUILTIN_RWLOCK_ADAPTIVE_SPIN_MAX ?
+    max_cnt : ATBUILTIN_RWLOCK_ADAPTIVE_SPIN_MAX;
+}
+
+static inline void atbuiltin_spin_update_count(int *spin_count, int cnt)
+{
+  int cur = atbuiltin_load_n(spin_count, ATBUILTIN_RWLOCK_RELAXED);
+  atbuiltin_store_n(spin_count, cur + (cnt - cur) / 8,
+    ATBUILTIN_RWLOCK_RELAXED);
+}
+
+/*
+  With adaptive spin, a writer spins for a while before it sleeps in
+  atbuiltin_wait_readers, because short critical sections end soon.
+*/
+static inline bool atbuiltin_spin_wait_readers(atbuiltin_rwlock_t *lock)
+{
+#ifndef ATBUILTIN_RWLOCK_WITHOUT_SPIN_LOCK
+  int cnt, max_cnt;
+  if (lock->spin_type != ATBUILTIN_RWLOCK_SPIN_ADAPTIVE)
+  {
+    return false;
+  }
+  max_cnt = atbuiltin_spin_max_count(&lock->drain_spin_count);
+  for (cnt = 0; cnt < max_cnt; cnt++)
+  {
+    atbuiltin_cpu_relax();
+    if (!atbuiltin_rwlock_drain_busy(lock,
+      atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED)))
+    {
+      atbuiltin_spin_update_count(&lock->drain_spin_count, cnt);
+      return true;
+    }
+  }
+  atbuiltin_spin_update_count(&lock->drain_spin_count, cnt);
+#endif
+  return false;
+}
+
+/*
+  Exponential backoff with jitter. The first steps spin with CPU relax, and
+  later steps sleep. Each step waits a random time between a half and all of
+  its length, and the sleep is capped by write_lock_interval when it is set.
+  Steps are counted in the backoff object, and the counts are added to the
+  lock by atbuiltin_rwlock_backoff_destroy when the wait ends.
+*/
+#define ATBUILTIN_RWLOCK_BACKOFF_SPIN_STEPS 10
+#define ATBUILTIN_RWLOCK_BACKOFF_MIN_SLEEP 1000ULL
+#define ATBUILTIN_RWLOCK_BACKOFF_MAX_STEPS 40
+#define ATBUILTIN_RWLOCK_BACKOFF_MAX_SLEEP 1000000ULL
+static inline unsigned int atbuiltin_backoff_random(atbuiltin_rwlock_backoff_t *backoff)
+{
+  unsigned int x = backoff->seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return backoff->seed = x;
+}
+
+static inline bool atbuiltin_backoff_step(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_backoff_t *backoff, struct timespec *ts)
+{
+  unsigned int i, spins;
+  unsigned long long int nsec, max_nsec;
+  if (backoff->count < ATBUILTIN_RWLOCK_BACKOFF_SPIN_STEPS)
+  {
+    spins = 1U << backoff->count++;
+    spins = spins / 2 + atbuiltin_backoff_random(backoff) % (spins / 2 + 1);
+    for (i = 0; i < spins; i++)
+    {
+      atbuiltin_cpu_relax();
+    }
+    backoff->spin_steps++;
+    return false;
+  }
+  max_nsec = lock->write_lock_interval ?
+    lock->write_lock_interval : ATBUILTIN_RWLOCK_BACKOFF_MAX_SLEEP;
+  nsec = ATBUILTIN_RWLOCK_BACKOFF_MIN_SLEEP <<
+    (backoff->count - ATBUILTIN_RWLOCK_BACKOFF_SPIN_STEPS);
+  if (nsec >= max_nsec)
+  {
+    nsec = max_nsec;
+  } else if (backoff->count < ATBUILTIN_RWLOCK_BACKOFF_MAX_STEPS) {
+    backoff->count++;
+  }
+  nsec = nsec / 2 + atbuiltin_backoff_random(backoff) % (nsec / 2 + 1);
+  get_timespec_from_nanosec(ts, nsec);
+  backoff->sleeps++;
+  backoff->sleep_nsec += nsec;
+  return true;
+}
+
+static inline bool atbuiltin_bias_readers_busy(atbuiltin_rwlock_t *lock)
+{
+  int i;
+  for (i = 0; i < ATBUILTIN_RWLOCK_VISIBLE_READERS; i++)
+  {
+    if (atbuiltin_load_n(&atbuiltin_visible_readers[i],
+      ATBUILTIN_RWLOCK_ACQUIRE) == lock)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+  Called by a writer which holds the lock. With try_only, it does not wait
+  for readers in atbuiltin_visible_readers and returns EBUSY. When it gives
+  up, read_bias is set back, because the next writer must wait for the same
+  readers.
+*/
+static inline int atbuiltin_bias_revoke(atbuiltin_rwlock_t *lock, bool try_only, const struct timespec *abstime)
+{
+  int i, res;
+  unsigned long long int cnt = 0;
+  struct timespec tsb, tsc;
+  if (!atbuiltin_load_n(&lock->read_bias, ATBUILTIN_RWLOCK_RELAXED))
+  {
+    return 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &tsb);
+  atbuiltin_store_n(&lock->read_bias, 0, ATBUILTIN_RWLOCK_RELAXED);
+  atbuiltin_thread_fence(ATBUILTIN_RWLOCK_SEQ_CST);
+  for (i = 0; atbuiltin_bias_readers_busy(lock); i++)
+  {
+    if (try_only)
+    {
+      atbuiltin_store_n(&lock->read_bias, 1, ATBUILTIN_RWLOCK_RELAXED);
+      return EBUSY;
+    }
+    if (lock->wait_type == ATBUILTIN_RWLOCK_WAIT_SPIN)
+    {
+      if ((res = atbuiltin_busy_wait(lock, &cnt, abstime)))
+      {
+        atbuiltin_store_n(&lock->read_bias, 1, ATBUILTIN_RWLOCK_RELAXED);
+        return res;
+      }
+      continue;
+    }
+    if (abstime && atbuiltin_deadline_passed(abstime))
+    {
+      atbuiltin_store_n(&lock->read_bias, 1, ATBUILTIN_RWLOCK_RELAXED);
+      return ETIMEDOUT;
+    }
+    if (i < ATBUILTIN_RWLOCK_SPIN_LOOPS)
+    {
+      atbuiltin_cpu_relax();
+    } else {
+      sched_yield();
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &tsc);
+  atbuiltin_store_n(&lock->bias_inhibit_until, get_nanosec_from_timespec(&tsc) +
+    (get_nanosec_from_timespec(&tsc) - get_nanosec_from_timespec(&tsb)) *
+    ATBUILTIN_RWLOCK_BIAS_INHIBIT_MULTIPLIER, ATBUILTIN_RWLOCK_RELAXED);
+  return 0;
+}
+
+/*
+  write_seq is odd while a writer holds the lock. Writers bump it right after
+  they set the write bits and right before they clear them, so an optimistic
+  reader which sees the same even value before and after its read section
+  knows that no writer ran in between. With sync builtins, atbuiltin_load_n
+  writes to the variable, so optimistic readers use a volatile load instead.
+*/
+static inline unsigned int atbuiltin_write_seq_load(atbuiltin_rwlock_t *lock)
+{
+#ifdef ATBUILTIN_RWLOCK_USE_SYNC_BUILTIN
+  return *(volatile unsigned int *) &lock->write_seq;
+#else
+  return atbuiltin_load_n(&lock->write_seq, ATBUILTIN_RWLOCK_RELAXED);
+#endif
+}
+
+static inline void atbuiltin_write_seq_enter(atbuiltin_rwlock_t *lock)
+{
+  atbuiltin_add_and_fetch(&lock->write_seq, 1, ATBUILTIN_RWLOCK_RELAXED);
+  atbuiltin_thread_fence(ATBUILTIN_RWLOCK_RELEASE);
+}
+
+static inline void atbuiltin_write_seq_exit(atbuiltin_rwlock_t *lock)
+{
+  atbuiltin_add_and_fetch(&lock->write_seq, 1, ATBUILTIN_RWLOCK_RELEASE);
+}
+
+/*
+  With ATBUILTIN_RWLOCK_WAIT_PI, a writer takes write_owner before the CAS
+  which sets WRITE_LOCKED, and releases it when the CAS fails or after it
+  clears WRITE_LOCKED. So whenever WRITE_LOCKED is set, write_owner holds the
+  TID of the writer which holds the lock, and no waiter can take it in
+  between. write_owner can still be held by the last writer or by a waiter
+  which is just passing through it, and this writer waits for them with its
+  priority lent to them. A failure of FUTEX_LOCK_PI is returned, and then the
+  writer does not set WRITE_LOCKED.
+*/
+static inline int atbuiltin_write_owner_enter(atbuiltin_rwlock_t *lock, const struct timespec *abstime)
+{
+  if (lock->wait_type == ATBUILTIN_RWLOCK_WAIT_PI)
+  {
+    return atbuiltin_pi_mutex_timedlock(&lock->write_owner, abstime,
+      atbuiltin_futex_flag(lock));
+  }
+  return 0;
+}
+
+static inline void atbuiltin_write_owner_exit(atbuiltin_rwlock_t *lock)
+{
+  if (lock->wait_type == ATBUILTIN_RWLOCK_WAIT_PI)
+  {
+    atbuiltin_pi_mutex_unlock(&lock->write_owner, atbuiltin_futex_flag(lock));
+  }
+}
+
+/*
+  Uncontended writers take the lock with one CAS and never touch the mutex.
+  This fails when readers hold or wait for the lock, or other writers hold or
+  wait for it. Readers in per-CPU read counters are checked after the write
+  bits are set, and the lock is released again if any of them is left.
+*/
+static inline int atbuiltin_rwlock_write_trylock(atbuiltin_rwlock_t *lock)
+{
+  atbuiltin_rwlock_state state;
+  if (
+    lock->read_counter_type == ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU &&
+    atbuiltin_read_slots_busy(lock)
+  ) {
+    return EBUSY;
+  }
+  if (
+    lock->wait_type == ATBUILTIN_RWLOCK_WAIT_PI &&
+    atbuiltin_pi_mutex_trylock(&lock->write_owner)
+  ) {
+    return EBUSY;
+  }
+  do {
+    state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED);
+    if (state & (ATBUILTIN_RWLOCK_READER_MASK |
+      ATBUILTIN_RWLOCK_READ_WAITER_MASK | ATBUILTIN_RWLOCK_WRITER_MASK |
+      ATBUILTIN_RWLOCK_WRITE_LOCKED))
+    {
+      atbuiltin_write_owner_exit(lock);
+      return EBUSY;
+    }
+  } while (!atbuiltin_compare_and_swap_n(&lock->lock_body, &state,
+    (state + ATBUILTIN_RWLOCK_WRITER_ONE) | ATBUILTIN_RWLOCK_WRITE_LOCKED |
+    ATBUILTIN_RWLOCK_WRITE_WAITING, ATBUILTIN_RWLOCK_CAS_WEAK,
+    ATBUILTIN_RWLOCK_ACQUIRE, ATBUILTIN_RWLOCK_RELAXED));
+  atbuiltin_write_seq_enter(lock);
+  if (
+    lock->read_counter_type == ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU &&
+    atbuiltin_read_slots_busy(lock)
+  ) {
+    atbuiltin_rwlock_write_exit(lock,
+      (int) (state >> ATBUILTIN_RWLOCK_PRIORITY_SHIFT), true);
+    return EBUSY;
+  }
+  /* lock success */
+  return 0;
+}
+
+/*
+  Under read priority, new readers keep getting the lock while a writer waits
+  for readers. With write_wait_cap, a writer which has waited for that long
+  stops new readers by WRITE_WAITING like the other priorities. write_exit
+  clears it as usual, so read priority comes back after that writer.
+  cap_end is 0 until the writer first has to wait.
+*/
+static inline bool atbuiltin_write_wait_capped(atbuiltin_rwlock_t *lock, unsigned long long int *cap_end)
+{
+  unsigned long long int now;
+  struct timespec tsc;
+  if (!lock->write_wait_cap)
+  {
+    return false;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &tsc);
+  now = get_nanosec_from_timespec(&tsc);
+  if (!*cap_end)
+  {
+    *cap_end = now + lock->write_wait_cap;
+    return false;
+  }
+  return now >= *cap_end;
+}
+
+/*
+  A sleeping writer wakes up by the deadline, write_lock_interval, the backoff
+  sleep tsb, or the end of write_wait_cap, whichever comes first. The deadline
+  is returned as it is when none of the others is set, and otherwise the
+  earliest one is set to tsw.
+*/
+static inline const struct timespec *atbuiltin_write_wait_timeout(atbuiltin_rwlock_t *lock, const struct timespec *abstime, atbuiltin_rwlock_state state, unsigned long long int cap_end, const struct timespec *tsb, struct timespec *tsw)
+{
+  unsigned long long int now, end = ULLONG_MAX;
+  struct timespec tsc;
+  if (cap_end && (state & ATBUILTIN_RWLOCK_WRITE_WAITING))
+  {
+    cap_end = 0;
+  }
+  if (!lock->write_lock_interval && !tsb && !cap_end)
+  {
+    return abstime;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &tsc);
+  now = get_nanosec_from_timespec(&tsc);
+  if (abstime)
+  {
+    end = get_nanosec_from_timespec(abstime);
+  }
+  if (lock->write_lock_interval && now + lock->write_lock_interval < end)
+  {
+    end = now + lock->write_lock_interval;
+  }
+  if (tsb && now + get_nanosec_from_timespec(tsb) < end)
+  {
+    end = now + get_nanosec_from_timespec(tsb);
+  }
+  if (cap_end && cap_end < end)
+  {
+    end = cap_end;
+  }
+  get_timespec_from_nanosec(tsw, end);
+  return tsw;
+}
+
+/*
+  Called by a writer which is counted in lock_body and holds the mutex, so
+  only one writer waits here at a time. Sets the write bits once no reader and
+  no other writer holds the lock. Except read priority, new readers are
+  stopped by WRITE_WAITING while this writer waits. With per-CPU read
+  counters, WRITE_WAITING is always set first, because the slots can be
+  checked only while no new reader comes in.
+*/
+static inline int atbuiltin_rwlock_write_drain_wait(atbuiltin_rwlock_t *lock, int priority, const struct timespec *abstime, atbuiltin_rwlock_backoff_t *backoff)
+{
+  int res;
+  unsigned long long int cnt = 0, cap_end = 0;
+  atbuiltin_rwlock_state state;
+  const struct timespec *ts;
+  struct timespec tsb, tsw;
+  while (true)
+  {
+    state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED);
+    if (
+      !(state & (ATBUILTIN_RWLOCK_READER_MASK |
+        ATBUILTIN_RWLOCK_WRITE_LOCKED)) &&
+      (
+        lock->read_counter_type != ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU ||
+        (
+          (state & ATBUILTIN_RWLOCK_WRITE_WAITING) &&
+          !atbuiltin_read_slots_busy(lock)
+        )
+      )
+    ) {
+      if ((res = atbuiltin_write_owner_enter(lock, abstime)))
+      {
+        return res;
+      }
+      if (atbuiltin_compare_and_swap_n(&lock->lock_body, &state,
+        state | ATBUILTIN_RWLOCK_WRITE_LOCKED | ATBUILTIN_RWLOCK_WRITE_WAITING,
+        ATBUILTIN_RWLOCK_CAS_WEAK, ATBUILTIN_RWLOCK_ACQUIRE,
+        ATBUILTIN_RWLOCK_RELAXED))
+      {
+        atbuiltin_write_seq_enter(lock);
+        /* lock success */
+        return 0;
+      }
+      atbuiltin_write_owner_exit(lock);
+      continue;
+    }
+    if (
+      !(state & ATBUILTIN_RWLOCK_WRITE_WAITING) &&
+      (
+        priority != ATBUILTIN_RWLOCK_READ_PRIORITY ||
+        lock->read_counter_type == ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU ||
+        atbuiltin_write_wait_capped(lock, &cap_end)
+      )
+    ) {
+      atbuiltin_compare_and_swap_n(&lock->lock_body, &state,
+        state | ATBUILTIN_RWLOCK_WRITE_WAITING, ATBUILTIN_RWLOCK_CAS_WEAK,
+        ATBUILTIN_RWLOCK_RELAXED, ATBUILTIN_RWLOCK_RELAXED);
+      continue;
+    }
+    if (lock->wait_type == ATBUILTIN_RWLOCK_WAIT_SPIN)
+    {
+      if ((res = atbuiltin_busy_wait(lock, &cnt, abstime)))
+      {
+        return res;
+      }
+      continue;
+    }
+    if (lock->backoff_type == ATBUILTIN_RWLOCK_BACKOFF_EXPONENTIAL)
+    {
+      if (atbuiltin_backoff_step(lock, backoff, &tsb))
+      {
+        ts = atbuiltin_write_wait_timeout(lock, abstime, state, cap_end, &tsb,
+          &tsw);
+        if ((res = atbuiltin_wait_error(atbuiltin_wait_readers(lock, ts),
+          ts, abstime)))
+        {
+          return res;
+        }
+      } else if (abstime && atbuiltin_deadline_passed(abstime)) {
+        return ETIMEDOUT;
+      }
+      continue;
+    }
+    if (atbuiltin_spin_wait_readers(lock))
+    {
+      continue;
+    }
+    ts = atbuiltin_write_wait_timeout(lock, abstime, state, cap_end, NULL,
+      &tsw);
+    if ((res = atbuiltin_wait_error(atbuiltin_wait_readers(lock, ts), ts,
+      abstime)))
+    {
+      return res;
+    }
+  }
+}
+
+static inline int atbuiltin_rwlock_write_drain(atbuiltin_rwlock_t *lock, int priority, const struct timespec *abstime)
+{
+  int res;
+  atbuiltin_rwlock_backoff_t backoff;
+  atbuiltin_rwlock_backoff_init(lock, &backoff);
+  res = atbuiltin_rwlock_write_drain_wait(lock, priority, abstime, &backoff);
+  atbuiltin_rwlock_backoff_destroy(lock, &backoff);
+  return res;
+}
+
+#define ATBUILTIN_RWLOCK_ADAPTIVE_SAMPLE 16
+#define ATBUILTIN_RWLOCK_ADAPTIVE_WINDOW 4096
+#define ATBUILTIN_RWLOCK_ADAPTIVE_HYSTERESIS 4
+#define ATBUILTIN_RWLOCK_ADAPTIVE_STREAK 4
+#define ATBUILTIN_RWLOCK_ADAPTIVE_MAX_REVERSALS 6
+#define ATBUILTIN_RWLOCK_ADAPTIVE_MIN_WAIT 100000ULL
+#define ATBUILTIN_RWLOCK_ADAPTIVE_WRITE_WAIT_CAP 10000000ULL
+#define ATBUILTIN_RWLOCK_ADAPTIVE_SWITCHING (1ULL << 63)
+
+/*
+  Each thread counts its acquisitions of adaptive locks in slots hashed by the
+  lock. A lock which takes over a slot drops the count of the old lock, which
+  is less than ATBUILTIN_RWLOCK_ADAPTIVE_SAMPLE, so a sample is only added to
+  the lock whose acquisitions made it.
+*/
+#define ATBUILTIN_RWLOCK_ADAPTIVE_TICKS_BITS 4
+#define ATBUILTIN_RWLOCK_ADAPTIVE_TICKS \
+  (1 << ATBUILTIN_RWLOCK_ADAPTIVE_TICKS_BITS)
+struct atbuiltin_adaptive_tick_t
+{
+  atbuiltin_rwlock_t *lock;
+  unsigned int tick;
+};
+static __thread atbuiltin_adaptive_tick_t atbuiltin_adaptive_ticks[
+  ATBUILTIN_RWLOCK_ADAPTIVE_TICKS];
+
+/*
+  The writer functions are installed one at a time, so a writer of an
+  adaptive lock can take the lock by the function of one priority and release
+  it by the function of another. Such a pair leaves nothing stale. The
+  priority bits are only changed by atbuiltin_adaptive_switch while no writer
+  is in lock_body, never by the writer functions. Adaptive locks move only
+  between READ_PRIORITY, NO_PRIORITY and WRITE_PRIORITY, whose
+  atbuiltin_rwlock_write_exit all clear WRITE_WAITING when the last writer
+  leaves and hand the lock to waiting readers in the same way, and differ only
+  in whether a writer which waits goes before waiting readers. So a mixed pair
+  only lets one writer go in the order of the other priority.
+*/
+static inline void atbuiltin_rwlock_set_priority(atbuiltin_rwlock_t *lock, int priority)
+{
+  switch (priority)
+  {
+    case ATBUILTIN_RWLOCK_READ_PRIORITY:
+      atbuiltin_store_n(&lock->timedwlock,
+        &atbuiltin_rwlock_timedwlock_read_priority, ATBUILTIN_RWLOCK_RELEASE);
+      atbuiltin_store_n(&lock->wlock,
+        &atbuiltin_rwlock_wlock_read_priority, ATBUILTIN_RWLOCK_RELEASE);
+      atbuiltin_store_n(&lock->wunlock,
+        &atbuiltin_rwlock_wunlock_read_priority, ATBUILTIN_RWLOCK_RELEASE);
+      break;
+    case ATBUILTIN_RWLOCK_WRITE_PRIORITY:
+      atbuiltin_store_n(&lock->timedwlock,
+        &atbuiltin_rwlock_timedwlock_write_priority, ATBUILTIN_RWLOCK_RELEASE);
+      atbuiltin_store_n(&lock->wlock,
+        &atbuiltin_rwlock_wlock_write_priority, ATBUILTIN_RWLOCK_RELEASE);
+      atbuiltin_store_n(&lock->wunlock,
+        &atbuiltin_rwlock_wunlock_write_priority, ATBUILTIN_RWLOCK_RELEASE);
+      break;
+    case ATBUILTIN_RWLOCK_PHASE_FAIR:
+      atbuiltin_store_n(&lock->timedwlock,
+        &atbuiltin_rwlock_timedwlock_phase_fair, ATBUILTIN_RWLOCK_RELEASE);
+      atbuiltin_store_n(&lock->wlock,
+        &atbuiltin_rwlock_wlock_phase_fair, ATBUILTIN_RWLOCK_RELEASE);
+      atbuiltin_store_n(&lock->wunlock,
+        &atbuiltin_rwlock_wunlock_phase_fair, ATBUILTIN_RWLOCK_RELEASE);
+      break;
+    default:
+      atbuiltin_store_n(&lock->timedwlock,
+        &atbuiltin_rwlock_timedwlock_no_priority, ATBUILTIN_RWLOCK_RELEASE);
+      atbuiltin_store_n(&lock->wlock,
+        &atbuiltin_rwlock_wlock_no_priority, ATBUILTIN_RWLOCK_RELEASE);
+      atbuiltin_store_n(&lock->wunlock,
+        &atbuiltin_rwlock_wunlock_no_priority, ATBUILTIN_RWLOCK_RELEASE);
+      break;
+  }
+}
+
+/*
+  Samples one acquisition of an adaptive lock. Each thread adds to
+  adaptive_ops only every ATBUILTIN_RWLOCK_ADAPTIVE_SAMPLE acquisitions of
+  that lock, so that the fast paths do not write a shared counter each time.
+  tss is set when the acquisition had to wait, and the time from tss is added
+  to the wait total of readers or writers.
+*/
+static inline void atbuiltin_adaptive_sample(atbuiltin_rwlock_t *lock, bool write, const struct timespec *tss)
+{
+  struct timespec tsc;
+  atbuiltin_adaptive_tick_t *tick;
+  if (!lock->adaptive_type)
+  {
+    return;
+  }
+  if (tss)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &tsc);
+    atbuiltin_add_and_fetch(
+      write ? &lock->adaptive_write_wait : &lock->adaptive_read_wait,
+      get_nanosec_from_timespec(&tsc) - get_nanosec_from_timespec(tss),
+      ATBUILTIN_RWLOCK_RELAXED);
+  }
+  tick = &atbuiltin_adaptive_ticks[
+    ((unsigned long long int) (unsigned long) lock * 0x9E3779B97F4A7C15ULL) >>
+    (64 - ATBUILTIN_RWLOCK_ADAPTIVE_TICKS_BITS)];
+  if (tick->lock != lock)
+  {
+    tick->lock = lock;
+    tick->tick = 0;
+  }
+  if (!(++tick->tick % ATBUILTIN_RWLOCK_ADAPTIVE_SAMPLE))
+  {
+    atbuiltin_add_and_fetch(&lock->adaptive_ops,
+      ATBUILTIN_RWLOCK_ADAPTIVE_SAMPLE, ATBUILTIN_RWLOCK_RELAXED);
+  }
+}
+
+/*
+  Readers do not look at the priority, so it can be switched while no writer
+  holds or waits for the lock.
+*/
+static inline bool atbuiltin_rwlock_adaptive_busy(atbuiltin_rwlock_state state)
+{
+  return state & (ATBUILTIN_RWLOCK_WRITER_MASK |
+    ATBUILTIN_RWLOCK_WRITE_WAITING | ATBUILTIN_RWLOCK_WRITE_LOCKED);
+}
+
+/*
+  Called by a writer which left an adaptive lock with no writer in
+  lock_body. After each ATBUILTIN_RWLOCK_ADAPTIVE_WINDOW acquisitions, the
+  side which waited ATBUILTIN_RWLOCK_ADAPTIVE_HYSTERESIS times longer than the
+  other wins the window. The priority moves one step of READ_PRIORITY,
+  NO_PRIORITY and WRITE_PRIORITY to a side which wins
+  ATBUILTIN_RWLOCK_ADAPTIVE_STREAK windows without the other side winning one.
+  Each switch back to where the last one came from doubles the windows
+  needed, up to ATBUILTIN_RWLOCK_ADAPTIVE_MAX_REVERSALS times, so the lock
+  does not flap between two priorities which each make the other side wait.
+  The priority bits are changed by a CAS which expects no writer to be in
+  lock_body, and the writer functions are installed after it.
+  The writer which ends a window sets ATBUILTIN_RWLOCK_ADAPTIVE_SWITCHING in
+  adaptive_ops by the CAS which starts the next window, and clears it when it
+  is done. Only that writer touches adaptive_streak, adaptive_direction and
+  adaptive_reversals, and the CAS and the clear order it after the last one.
+*/
+static void atbuiltin_adaptive_decide(atbuiltin_rwlock_t *lock)
+{
+  int priority, direction = 0;
+  unsigned long long int read_wait, write_wait;
+  atbuiltin_rwlock_state state;
+  read_wait = atbuiltin_exchange_n(&lock->adaptive_read_wait, 0,
+    ATBUILTIN_RWLOCK_RELAXED);
+  write_wait = atbuiltin_exchange_n(&lock->adaptive_write_wait, 0,
+    ATBUILTIN_RWLOCK_RELAXED);
+  if (
+    write_wait >= ATBUILTIN_RWLOCK_ADAPTIVE_MIN_WAIT &&
+    write_wait / ATBUILTIN_RWLOCK_ADAPTIVE_HYSTERESIS > read_wait
+  ) {
+    direction = 1;
+  } else if (
+    read_wait >= ATBUILTIN_RWLOCK_ADAPTIVE_MIN_WAIT &&
+    read_wait / ATBUILTIN_RWLOCK_ADAPTIVE_HYSTERESIS > write_wait
+  ) {
+    direction = -1;
+  }
+  if (!direction)
+  {
+    return;
+  }
+  if ((direction > 0) != (lock->adaptive_streak > 0))
+  {
+    lock->adaptive_streak = 0;
+  }
+  lock->adaptive_streak += direction;
+  if (
+    lock->adaptive_streak * direction <
+    ATBUILTIN_RWLOCK_ADAPTIVE_STREAK << lock->adaptive_reversals
+  ) {
+    return;
+  }
+  lock->adaptive_streak = 0;
+  state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED);
+  priority = (int) (state >> ATBUILTIN_RWLOCK_PRIORITY_SHIFT) + direction;
+  if (
+    priority < ATBUILTIN_RWLOCK_READ_PRIORITY ||
+    priority > ATBUILTIN_RWLOCK_WRITE_PRIORITY
+  ) {
+    return;
+  }
+  do {
+    state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED);
+    if (atbuiltin_rwlock_adaptive_busy(state))
+    {
+      return;
+    }
+  } while (!atbuiltin_compare_and_swap_n(&lock->lock_body, &state,
+    (state & ~ATBUILTIN_RWLOCK_PRIORITY_MASK) |
+    (atbuiltin_rwlock_state) priority << ATBUILTIN_RWLOCK_PRIORITY_SHIFT,
+    ATBUILTIN_RWLOCK_CAS_WEAK, ATBUILTIN_RWLOCK_RELAXED,
+    ATBUILTIN_RWLOCK_RELAXED));
+  atbuiltin_rwlock_set_priority(lock, priority);
+  if (direction != lock->adaptive_direction)
+  {
+    if (
+      lock->adaptive_direction &&
+      lock->adaptive_reversals < ATBUILTIN_RWLOCK_ADAPTIVE_MAX_REVERSALS
+    ) {
+      lock->adaptive_reversals++;
+    }
+  } else {
+    lock->adaptive_reversals = 0;
+  }
+  lock->adaptive_direction = direction;
+  atbuiltin_add_and_fetch(&lock->adaptive_switches, 1,
+    ATBUILTIN_RWLOCK_RELAXED);
+}
+
+static void atbuiltin_adaptive_switch(atbuiltin_rwlock_t *lock)
+{
+  unsigned long long int ops;
+  ops = atbuiltin_load_n(&lock->adaptive_ops, ATBUILTIN_RWLOCK_RELAXED);
+  if (
+    (ops & ATBUILTIN_RWLOCK_ADAPTIVE_SWITCHING) ||
+    ops < ATBUILTIN_RWLOCK_ADAPTIVE_WINDOW ||
+    !atbuiltin_compare_and_swap_n(&lock->adaptive_ops, &ops,
+      ATBUILTIN_RWLOCK_ADAPTIVE_SWITCHING, ATBUILTIN_RWLOCK_CAS_WEAK,
+      ATBUILTIN_RWLOCK_ACQUIRE, ATBUILTIN_RWLOCK_RELAXED)
+  ) {
+    return;
+  }
+  atbuiltin_adaptive_decide(lock);
+  atbuiltin_sub_and_fetch(&lock->adaptive_ops,
+    ATBUILTIN_RWLOCK_ADAPTIVE_SWITCHING, ATBUILTIN_RWLOCK_RELEASE);
+}
+
+/*
+  Called by the writer which holds the lock, with the number of times the
+  lock went from a writer to the next writer in a row while readers waited.
+  write_batch_start is taken when the first of those hand-offs happens.
+*/
+static inline bool atbuiltin_write_batch_full(atbuiltin_rwlock_t *lock, unsigned int batch_count)
+{
+  unsigned long long int now = 0;
+  struct timespec tsc;
+  if (lock->write_batch_time)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &tsc);
+    now = get_nanosec_from_timespec(&tsc);
+  }
+  if (!batch_count)
+  {
+    lock->write_batch_start = now;
+    return false;
+  }
+  return
+    (lock->write_batch && batch_count >= lock->write_batch) ||
+    (lock->write_batch_time &&
+      now - lock->write_batch_start >= lock->write_batch_time);
+}
+
+/*
+  Drops this writer from lock_body with one CAS, and releases the lock when
+  the writer holds it. WRITE_WAITING is cleared when
+  no other writer is left, or, except write priority, when readers are
+  waiting. Otherwise readers stay blocked and the writer in
+  atbuiltin_rwlock_write_drain takes the lock next.
+  With phase fair, WRITE_WAITING is cleared only when no other writer is left,
+  and the writer which holds the lock gives it to all waiting readers in the
+  same CAS by moving them to the reader count and flipping READ_PHASE. The
+  next writer waits for only those readers, and readers which come after them
+  wait for that writer. READ_PHASE is not flipped again until the next writer
+  gets the lock, which needs all given readers to notice it and leave.
+  With write_batch or write_batch_time, the other priorities count how many
+  times in a row the lock went from a writer to the next writer while readers
+  were waiting. Once the batch is full, the waiting readers are given the lock
+  in the same way as phase fair, and the count starts again.
+  With read_max, waiting readers are given the lock in this way only when all
+  of them fit in it. Otherwise WRITE_WAITING is cleared instead, and they take
+  the lock by themselves up to read_max before the next writer stops them.
+  With ATBUILTIN_RWLOCK_ADAPTIVE, the last writer which leaves the lock may
+  switch the priority.
+*/
+static inline bool atbuiltin_rwlock_read_grantable(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_state state)
+{
+  unsigned int max = atbuiltin_load_n(&lock->read_max,
+    ATBUILTIN_RWLOCK_RELAXED);
+  return
+    !max ||
+    (state & ATBUILTIN_RWLOCK_READ_WAITER_MASK) /
+      ATBUILTIN_RWLOCK_READ_WAITER_ONE <= max;
+}
+
+static inline void atbuiltin_rwlock_write_exit(atbuiltin_rwlock_t *lock, int priority, bool locked)
+{
+  atbuiltin_rwlock_state state, new_state;
+  unsigned int batch_count = lock->write_batch_count;
+  bool batch =
+    locked && priority != ATBUILTIN_RWLOCK_PHASE_FAIR &&
+    (lock->write_batch || lock->write_batch_time);
+  if (locked)
+  {
+    atbuiltin_write_seq_exit(lock);
+  }
+  do {
+    state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED);
+    new_state = state - ATBUILTIN_RWLOCK_WRITER_ONE;
+    if (locked)
+    {
+      new_state &= ~ATBUILTIN_RWLOCK_WRITE_LOCKED;
+    }
+    if (priority == ATBUILTIN_RWLOCK_PHASE_FAIR)
+    {
+      if (!(new_state & ATBUILTIN_RWLOCK_WRITER_MASK))
+      {
+        new_state &= ~ATBUILTIN_RWLOCK_WRITE_WAITING;
+      }
+      if (locked && (state & ATBUILTIN_RWLOCK_READ_WAITER_MASK))
+      {
+        if (atbuiltin_rwlock_read_grantable(lock, state))
+        {
+          new_state = ((new_state & ~ATBUILTIN_RWLOCK_READ_WAITER_MASK) +
+            (state & ATBUILTIN_RWLOCK_READ_WAITER_MASK) /
+            ATBUILTIN_RWLOCK_READ_WAITER_ONE * ATBUILTIN_RWLOCK_READER_ONE) ^
+            ATBUILTIN_RWLOCK_READ_PHASE;
+        } else {
+          new_state &= ~ATBUILTIN_RWLOCK_WRITE_WAITING;
+        }
+      }
+    } else {
+      if (batch)
+      {
+        if (
+          !(state & ATBUILTIN_RWLOCK_READ_WAITER_MASK) ||
+          !(new_state & ATBUILTIN_RWLOCK_WRITER_MASK)
+        ) {
+          lock->write_batch_count = 0;
+        } else if (atbuiltin_write_batch_full(lock, batch_count)) {
+          if (atbuiltin_rwlock_read_grantable(lock, state))
+          {
+            new_state = ((new_state & ~ATBUILTIN_RWLOCK_READ_WAITER_MASK) +
+              (state & ATBUILTIN_RWLOCK_READ_WAITER_MASK) /
+              ATBUILTIN_RWLOCK_READ_WAITER_ONE * ATBUILTIN_RWLOCK_READER_ONE) ^
+              ATBUILTIN_RWLOCK_READ_PHASE;
+          } else {
+            new_state &= ~ATBUILTIN_RWLOCK_WRITE_WAITING;
+          }
+          lock->write_batch_count = 0;
+        } else {
+          lock->write_batch_count = batch_count + 1;
+        }
+      }
+      if (
+        !(new_state & ATBUILTIN_RWLOCK_WRITER_MASK) ||
+        (
+          priority != ATBUILTIN_RWLOCK_WRITE_PRIORITY &&
+          (state & ATBUILTIN_RWLOCK_READ_WAITER_MASK)
+        )
+      ) {
+        new_state &= ~ATBUILTIN_RWLOCK_WRITE_WAITING;
+      }
+    }
+  } while (!atbuiltin_compare_and_swap_n(&lock->lock_body, &state, new_state,
+    ATBUILTIN_RWLOCK_CAS_WEAK, ATBUILTIN_RWLOCK_SEQ_CST,
+    ATBUILTIN_RWLOCK_RELAXED));
+  if (locked)
+  {
+    atbuiltin_write_owner_exit(lock);
+  }
+  if (new_state & ATBUILTIN_RWLOCK_WRITER_MASK)
+  {
+    atbuiltin_wake_drain_writer(lock);
+  }
+  if (
+    (state & ATBUILTIN_RWLOCK_READ_WAITER_MASK) &&
+    (
+      ((state ^ new_state) & ATBUILTIN_RWLOCK_READ_PHASE) ||
+      (
+        atbuiltin_rwlock_read_blocked(state) &&
+        !atbuiltin_rwlock_read_blocked(new_state)
+      )
+    )
+  ) {
+    atbuiltin_wake_readers(lock);
+  }
+  if (lock->adaptive_type && locked && !atbuiltin_rwlock_adaptive_busy(new_state))
+  {
+    atbuiltin_adaptive_switch(lock);
+  }
+}
+
+#ifdef ATBUILTIN_RWLOCK_WITHOUT_SPIN_LOCK
+static inline int atbuiltin_spin_timedlock(atbuiltin_rwlock_t *lock, const struct timespec *abstime)
+{
+  int res;
+  if ((res = atbuiltin_mutex_timedlock(lock, abstime)))
+  {
+    return res;
+  }
+  return 0;
+}
+
+static inline void atbuiltin_spin_lock(atbuiltin_rwlock_t *lock)
+{
+  atbuiltin_mutex_lock(lock);
+}
+
+static inline void atbuiltin_spin_unlock(atbuiltin_rwlock_t *lock)
+{
+  atbuiltin_mutex_unlock(lock);
+}
+#else
+static inline int atbuiltin_fixed_spin_trylock(atbuiltin_rwlock_t *lock)
+{
+  unsigned int i;
+  if (!atbuiltin_mutex_trylock(lock))
+  {
+    return 0;
+  }
+  for (i = 0; i < ATBUILTIN_RWLOCK_SPIN_LOOPS; i++)
+  {
+    atbuiltin_cpu_relax();
+    if (!atbuiltin_mutex_trylock(lock))
+    {
+      return 0;
+    }
+  }
+  return EBUSY;
+}
+
+/*
+  Spinning is useless while the mutex holder sleeps in
+  atbuiltin_wait_readers, or while it was last seen on this CPU, which means
+  it is not running now. mutex_owner_cpu holds that CPU plus 1, and 0 while
+  no holder is known.
+*/
+static inline bool atbuiltin_mutex_owner_running(atbuiltin_rwlock_t *lock, int cpu)
+{
+  return
+    !atbuiltin_load_n(&lock->drain_waiting, ATBUILTIN_RWLOCK_RELAXED) &&
+    atbuiltin_load_n(&lock->mutex_owner_cpu, ATBUILTIN_RWLOCK_RELAXED) !=
+      cpu + 1;
+}
+
+static inline int atbuiltin_adaptive_spin_trylock(atbuiltin_rwlock_t *lock)
+{
+  int cnt, max_cnt, cpu, res = EBUSY;
+  if (!atbuiltin_mutex_trylock(lock))
+  {
+    return 0;
+  }
+  max_cnt = atbuiltin_spin_max_count(&lock->mutex_spin_count);
+  cpu = sched_getcpu();
+  for (cnt = 0; cnt < max_cnt; cnt++)
+  {
+    if (!atbuiltin_mutex_owner_running(lock, cpu))
+    {
+      break;
+    }
+    atbuiltin_cpu_relax();
+    if (!atbuiltin_mutex_trylock(lock))
+    {
+      res = 0;
+      break;
+    }
+  }
+  atbuiltin_spin_update_count(&lock->mutex_spin_count, cnt);
+  return res;
+}
+
+static inline int atbuiltin_spin_trylock(atbuiltin_rwlock_t *lock)
+{
+  if (lock->spin_type == ATBUILTIN_RWLOCK_SPIN_ADAPTIVE)
+  {
+    return atbuiltin_adaptive_spin_trylock(lock);
+  }
+  return atbuiltin_fixed_spin_trylock(lock);
+}
+
+static inline void atbuiltin_spin_set_owner(atbuiltin_rwlock_t *lock)
+{
+  if (lock->spin_type == ATBUILTIN_RWLOCK_SPIN_ADAPTIVE)
+  {
+    atbuiltin_store_n(&lock->mutex_owner_cpu, sched_getcpu() + 1,
+      ATBUILTIN_RWLOCK_RELAXED);
+  }
+}
+
+static inline int atbuiltin_spin_timedlock(atbuiltin_rwlock_t *lock, const struct timespec *abstime)
+{
+  int res;
+  if (atbuiltin_spin_trylock(lock))
+  {
+    if ((res = atbuiltin_mutex_timedlock(lock, abstime)))
+    {
+      return res;
+    }
+  }
+  atbuiltin_spin_set_owner(lock);
+  return 0;
+}
+
+static inline void atbuiltin_spin_lock(atbuiltin_rwlock_t *lock)
+{
+  if (atbuiltin_spin_trylock(lock))
+  {
+    atbuiltin_mutex_lock(lock);
+  }
+  atbuiltin_spin_set_owner(lock);
+}
+
+static inline void atbuiltin_spin_unlock(atbuiltin_rwlock_t *lock)
+{
+  if (lock->spin_type == ATBUILTIN_RWLOCK_SPIN_ADAPTIVE)
+  {
+    atbuiltin_store_n(&lock->mutex_owner_cpu, 0, ATBUILTIN_RWLOCK_RELAXED);
+  }
+  atbuiltin_mutex_unlock(lock);
+}
+#endif
+
+/*
+  NUMA cohort. A writer takes the local lock of its node first, and then the
+  global lock, which is futex_mutex. A writer which gives up the global lock
+  while other writers of the same node wait for the local lock passes the
+  global lock to them with the local lock instead, up to cohort_batch times
+  in a row. global_held and batch_count of a node are used only by the holder
+  of its local lock. Since the global lock is passed between threads, it is
+  always a futex even with ATBUILTIN_RWLOCK_WAIT_PTHREAD.
+*/
+static inline atbuiltin_rwlock_cohort_node_t *atbuiltin_cohort_node(atbuiltin_rwlock_t *lock)
+{
+  return &lock->cohort_nodes[atbuiltin_numa_node() % lock->cohort_node_count];
+}
+
+static inline void atbuiltin_cohort_release(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_cohort_node_t *node)
+{
+  if (node->global_held)
+  {
+    node->global_held = 0;
+    node->batch_count = 0;
+    atbuiltin_futex_mutex_unlock(&lock->futex_mutex, atbuiltin_futex_flag(lock));
+  }
+  atbuiltin_futex_mutex_unlock(&node->mutex, atbuiltin_futex_flag(lock));
+}
+
+/*
+  A waiter which was counted when the global lock was passed may time out
+  instead of taking the local lock. The last one to leave takes the local
+  lock again, if nobody holds it, to release the global lock.
+*/
+static inline void atbuiltin_cohort_release_idle(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_cohort_node_t *node)
+{
+  if (
+    !atbuiltin_load_n(&node->waiters, ATBUILTIN_RWLOCK_SEQ_CST) &&
+    !atbuiltin_futex_mutex_trylock(&node->mutex)
+  ) {
+    atbuiltin_cohort_release(lock, node);
+  }
+}
+
+static inline int atbuiltin_cohort_timedlock(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_cohort_node_t **nodep, const struct timespec *abstime)
+{
+  int res;
+  atbuiltin_rwlock_cohort_node_t *node = atbuiltin_cohort_node(lock);
+  atbuiltin_add_and_fetch(&node->waiters, 1, ATBUILTIN_RWLOCK_SEQ_CST);
+  res = atbuiltin_futex_mutex_timedlock(&node->mutex, abstime,
+    atbuiltin_futex_flag(lock));
+  atbuiltin_sub_and_fetch(&node->waiters, 1, ATBUILTIN_RWLOCK_SEQ_CST);
+  if (res)
+  {
+    atbuiltin_cohort_release_idle(lock, node);
+    return res;
+  }
+  if (
+    !node->global_held &&
+    (res = atbuiltin_futex_mutex_timedlock(&lock->futex_mutex, abstime,
+      atbuiltin_futex_flag(lock)))
+  ) {
+    atbuiltin_futex_mutex_unlock(&node->mutex, atbuiltin_futex_flag(lock));
+    return res;
+  }
+  node->global_held = 1;
+  *nodep = node;
+  return 0;
+}
+
+static inline void atbuiltin_cohort_unlock(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_cohort_node_t *node)
+{
+  if (
+    node->batch_count < lock->cohort_batch &&
+    atbuiltin_load_n(&node->waiters, ATBUILTIN_RWLOCK_SEQ_CST)
+  ) {
+    node->batch_count++;
+    atbuiltin_futex_mutex_unlock(&node->mutex, atbuiltin_futex_flag(lock));
+    atbuiltin_cohort_release_idle(lock, node);
+    return;
+  }
+  atbuiltin_cohort_release(lock, node);
+}
+
+/*
+  Writers wait in turn on these before they drain readers.
+*/
+static inline int atbuiltin_writer_timedlock(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_cohort_node_t **nodep, const struct timespec *abstime)
+{
+  if (lock->cohort_type == ATBUILTIN_RWLOCK_COHORT_NUMA)
+  {
+    return atbuiltin_cohort_timedlock(lock, nodep, abstime);
+  }
+  if (abstime || lock->wait_type == ATBUILTIN_RWLOCK_WAIT_SPIN)
+  {
+    return atbuiltin_spin_timedlock(lock, abstime);
+  }
+  atbuiltin_spin_lock(lock);
+  return 0;
+}
+
+static inline void atbuiltin_writer_unlock(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_cohort_node_t *node)
+{
+  if (lock->cohort_type == ATBUILTIN_RWLOCK_COHORT_NUMA)
+  {
+    atbuiltin_cohort_unlock(lock, node);
+    return;
+  }
+  atbuiltin_spin_unlock(lock);
+}
+
+int atbuiltin_rwlockattr_init(atbuiltin_rwlock_attr_t *attr)
+{
+  int ret;
+  attr->rwlock_attr = ATBUILTIN_RWLOCK_READ_PRIORITY;
+  attr->wait_attr = ATBUILTIN_RWLOCK_WAIT_PTHREAD;
+  attr->spin_attr = ATBUILTIN_RWLOCK_SPIN_FIXED;
+  attr->backoff_attr = ATBUILTIN_RWLOCK_BACKOFF_NONE;
+  attr->read_counter_attr = ATBUILTIN_RWLOCK_READ_COUNTER_SHARED;
+  attr->bias_attr = ATBUILTIN_RWLOCK_BIAS_NONE;
+  attr->cohort_attr = ATBUILTIN_RWLOCK_COHORT_NONE;
+  attr->cohort_batch_attr = ATBUILTIN_RWLOCK_COHORT_BATCH;
+  attr->queue_order_attr = ATBUILTIN_RWLOCK_QUEUE_ORDER_FIFO;
+  attr->wait_spin_limit = 0;
+  attr->write_lock_interval = 0;
+  attr->write_wait_cap = 0;
+  attr->write_batch = 0;
+  attr->write_batch_time = 0;
+  attr->read_max = 0;
+  if ((ret = pthread_condattr_init(&attr->cond_attr)))
+    goto error_condattr_init;
+  if ((ret = pthread_mutexattr_init(&attr->mutex_attr)))
+    goto error_mutexattr_init;
+  return 0;
+
+error_mutexattr_init:
+  pthread_condattr_destroy(&attr->cond_attr);
+error_condattr_init:
+  return ret;
+}
+
+int atbuiltin_rwlockattr_destroy(atbuiltin_rwlock_attr_t *attr)
+{
+  int ret1, ret2;
+  ret1 = pthread_condattr_destroy(&attr->cond_attr);
+  ret2 = pthread_mutexattr_destroy(&attr->mutex_attr);
+  if (ret1)
+    return ret1;
+  return ret2;
+}
+
+int atbuiltin_rwlockattr_setpshared_cond(atbuiltin_rwlock_attr_t *attr, int pshared)
+{
+  return pthread_condattr_setpshared(&attr->cond_attr, pshared);
+}
+
+int atbuiltin_rwlockattr_getpshared_cond(atbuiltin_rwlock_attr_t *attr, int *pshared)
+{
+  return pthread_condattr_getpshared(&attr->cond_attr, pshared);
+}
+
+int atbuiltin_rwlockattr_settype_mutex(atbuiltin_rwlock_attr_t *attr, int kind)
+{
+  return pthread_mutexattr_settype(&attr->mutex_attr, kind);
+}
+
+int atbuiltin_rwlockattr_gettype_mutex(atbuiltin_rwlock_attr_t *attr, int *kind)
+{
+  return pthread_mutexattr_gettype(&attr->mutex_attr, kind);
+}
+
+int atbuiltin_rwlockattr_settype_priority(atbuiltin_rwlock_attr_t *attr, int priority)
+{
+  switch (priority)
+  {
+    case ATBUILTIN_RWLOCK_READ_PRIORITY:
+    case ATBUILTIN_RWLOCK_NO_PRIORITY:
+    case ATBUILTIN_RWLOCK_WRITE_PRIORITY:
+    case ATBUILTIN_RWLOCK_PHASE_FAIR:
+    case ATBUILTIN_RWLOCK_ADAPTIVE:
+      break;
+    default:
+      return EINVAL;
+  }
+  attr->rwlock_attr = priority;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_gettype_priority(atbuiltin_rwlock_attr_t *attr, int *priority)
+{
+  *priority = attr->rwlock_attr;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_settype_wait(atbuiltin_rwlock_attr_t *attr, int wait)
+{
+  switch (wait)
+  {
+    case ATBUILTIN_RWLOCK_WAIT_PTHREAD:
+    case ATBUILTIN_RWLOCK_WAIT_FUTEX:
+    case ATBUILTIN_RWLOCK_WAIT_QUEUE:
+    case ATBUILTIN_RWLOCK_WAIT_SPIN:
+    case ATBUILTIN_RWLOCK_WAIT_PI:
+      break;
+    default:
+      return EINVAL;
+  }
+  attr->wait_attr = wait;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_gettype_wait(atbuiltin_rwlock_attr_t *attr, int *wait)
+{
+  *wait = attr->wait_attr;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_settype_wait_spin_limit(atbuiltin_rwlock_attr_t *attr, unsigned long long int limit)
+{
+  attr->wait_spin_limit = limit;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_gettype_wait_spin_limit(atbuiltin_rwlock_attr_t *attr, unsigned long long int *limit)
+{
+  *limit = attr->wait_spin_limit;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_settype_spin(atbuiltin_rwlock_attr_t *attr, int spin)
+{
+  switch (spin)
+  {
+    case ATBUILTIN_RWLOCK_SPIN_FIXED:
+    case ATBUILTIN_RWLOCK_SPIN_ADAPTIVE:
+      break;
+    default:
+      return EINVAL;
+  }
+  attr->spin_attr = spin;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_gettype_spin(atbuiltin_rwlock_attr_t *attr, int *spin)
+{
+  *spin = attr->spin_attr;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_settype_backoff(atbuiltin_rwlock_attr_t *attr, int backoff)
+{
+  switch (backoff)
+  {
+    case ATBUILTIN_RWLOCK_BACKOFF_NONE:
+    case ATBUILTIN_RWLOCK_BACKOFF_EXPONENTIAL:
+      break;
+    default:
+      return EINVAL;
+  }
+  attr->backoff_attr = backoff;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_gettype_backoff(atbuiltin_rwlock_attr_t *attr, int *backoff)
+{
+  *backoff = attr->backoff_attr;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_settype_read_counter(atbuiltin_rwlock_attr_t *attr, int read_counter)
+{
+  switch (read_counter)
+  {
+    case ATBUILTIN_RWLOCK_READ_COUNTER_SHARED:
+    case ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU:
+      break;
+    default:
+      return EINVAL;
+  }
+  attr->read_counter_attr = read_counter;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_gettype_read_counter(atbuiltin_rwlock_attr_t *attr, int *read_counter)
+{
+  *read_counter = attr->read_counter_attr;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_settype_bias(atbuiltin_rwlock_attr_t *attr, int bias)
+{
+  switch (bias)
+  {
+    case ATBUILTIN_RWLOCK_BIAS_NONE:
+    case ATBUILTIN_RWLOCK_BIAS_READ:
+      break;
+    default:
+      return EINVAL;
+  }
+  attr->bias_attr = bias;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_gettype_bias(atbuiltin_rwlock_attr_t *attr, int *bias)
+{
+  *bias = attr->bias_attr;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_settype_cohort(atbuiltin_rwlock_attr_t *attr, int cohort)
+{
+  switch (cohort)
+  {
+    case ATBUILTIN_RWLOCK_COHORT_NONE:
+    case ATBUILTIN_RWLOCK_COHORT_NUMA:
+      break;
+    default:
+      return EINVAL;
+  }
+  attr->cohort_attr = cohort;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_gettype_cohort(atbuiltin_rwlock_attr_t *attr, int *cohort)
+{
+  *cohort = attr->cohort_attr;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_settype_cohort_batch(atbuiltin_rwlock_attr_t *attr, int batch)
+{
+  if (batch < 1)
+    return EINVAL;
+  attr->cohort_batch_attr = batch;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_gettype_cohort_batch(atbuiltin_rwlock_attr_t *attr, int *batch)
+{
+  *batch = attr->cohort_batch_attr;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_settype_queue_order(atbuiltin_rwlock_attr_t *attr, int order)
+{
+  switch (order)
+  {
+    case ATBUILTIN_RWLOCK_QUEUE_ORDER_FIFO:
+    case ATBUILTIN_RWLOCK_QUEUE_ORDER_DEADLINE:
+      break;
+    default:
+      return EINVAL;
+  }
+  attr->queue_order_attr = order;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_gettype_queue_order(atbuiltin_rwlock_attr_t *attr, int *order)
+{
+  *order = attr->queue_order_attr;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_settype_write_lock_interval(atbuiltin_rwlock_attr_t *attr, unsigned long long int interval)
+{
+  attr->write_lock_interval = interval;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_gettype_write_lock_interval(atbuiltin_rwlock_attr_t *attr, unsigned long long int *interval)
+{
+  *interval = attr->write_lock_interval;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_settype_write_wait_cap(atbuiltin_rwlock_attr_t *attr, unsigned long long int cap)
+{
+  attr->write_wait_cap = cap;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_gettype_write_wait_cap(atbuiltin_rwlock_attr_t *attr, unsigned long long int *cap)
+{
+  *cap = attr->write_wait_cap;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_settype_write_batch(atbuiltin_rwlock_attr_t *attr, unsigned int batch)
+{
+  attr->write_batch = batch;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_gettype_write_batch(atbuiltin_rwlock_attr_t *attr, unsigned int *batch)
+{
+  *batch = attr->write_batch;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_settype_write_batch_time(atbuiltin_rwlock_attr_t *attr, unsigned long long int batch_time)
+{
+  attr->write_batch_time = batch_time;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_gettype_write_batch_time(atbuiltin_rwlock_attr_t *attr, unsigned long long int *batch_time)
+{
+  *batch_time = attr->write_batch_time;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_settype_read_max(atbuiltin_rwlock_attr_t *attr, unsigned int max)
+{
+  if (max > ATBUILTIN_RWLOCK_READER_MASK)
+    return EINVAL;
+  attr->read_max = max;
+  return 0;
+}
+
+int atbuiltin_rwlockattr_gettype_read_max(atbuiltin_rwlock_attr_t *attr, unsigned int *max)
+{
+  *max = attr->read_max;
+  return 0;
+}
+
+static int atbuiltin_read_slots_init(atbuiltin_rwlock_t *lock, int count)
+{
+  int i;
+  void *slots;
+  if (posix_memalign(&slots, ATBUILTIN_RWLOCK_CACHE_LINE_SIZE,
+    sizeof(atbuiltin_rwlock_read_slot_t) * count))
+    return ENOMEM;
+  lock->read_slots = (atbuiltin_rwlock_read_slot_t *) slots;
+  lock->read_slot_count = count;
+  for (i = 0; i < lock->read_slot_count; i++)
+    lock->read_slots[i].readers = 0;
+  lock->read_counter_type = ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU;
+  return 0;
+}
+
+/*
+  The number of NUMA nodes is the largest node number in
+  /sys/devices/system/node/possible plus 1, such as "0-1" or "0,2-3".
+  It is 1 when the file is not found.
+*/
+static int atbuiltin_numa_node_count(void)
+{
+  int c, node = 0, max_node = 0;
+  FILE *fp;
+  if (!(fp = fopen("/sys/devices/system/node/possible", "r")))
+    return 1;
+  while ((c = fgetc(fp)) != EOF)
+  {
+    if (c >= '0' && c <= '9')
+    {
+      node = node * 10 + c - '0';
+      if (node > max_node)
+        max_node = node;
+    } else {
+      node = 0;
+    }
+  }
+  fclose(fp);
+  return max_node + 1;
+}
+
+static int atbuiltin_cohort_init(atbuiltin_rwlock_t *lock, int count)
+{
+  int i;
+  void *nodes;
+  if (posix_memalign(&nodes, ATBUILTIN_RWLOCK_CACHE_LINE_SIZE,
+    sizeof(atbuiltin_rwlock_cohort_node_t) * count))
+    return ENOMEM;
+  lock->cohort_nodes = (atbuiltin_rwlock_cohort_node_t *) nodes;
+  lock->cohort_node_count = count;
+  for (i = 0; i < lock->cohort_node_count; i++)
+  {
+    lock->cohort_nodes[i].mutex = 0;
+    lock->cohort_nodes[i].waiters = 0;
+    lock->cohort_nodes[i].global_held = 0;
+    lock->cohort_nodes[i].batch_count = 0;
+  }
+  lock->cohort_type = ATBUILTIN_RWLOCK_COHORT_NUMA;
+  return 0;
+}
+
+int atbuiltin_rwlock_init(atbuiltin_rwlock_t *lock, const atbuiltin_rwlock_attr_t *attr)
+{
+  int ret, pshared, nodes, priority;
+  long cpus;
+  lock->lock_body = 0;
+  lock->write_seq = 0;
+  lock->wait_type = ATBUILTIN_RWLOCK_WAIT_PTHREAD;
+  lock->wait_spin_limit = 0;
+  lock->futex_shared = 0;
+  lock->futex_mutex = 0;
+  lock->futex_read_seq = 0;
+  lock->write_owner = 0;
+  lock->pi_waiter = 0;
+  lock->drain_waiting = 0;
+  lock->wait_setup = ATBUILTIN_RWLOCK_WAIT_SETUP_NONE;
+  lock->spin_type = ATBUILTIN_RWLOCK_SPIN_FIXED;
+  lock->mutex_spin_count = 0;
+  lock->drain_spin_count = 0;
+  lock->mutex_owner_cpu = 0;
+  lock->backoff_type = ATBUILTIN_RWLOCK_BACKOFF_NONE;
+  lock->backoff_spin_steps = 0;
+  lock->backoff_sleeps = 0;
+  lock->backoff_sleep_nsec = 0;
+  lock->read_counter_type = ATBUILTIN_RWLOCK_READ_COUNTER_SHARED;
+  lock->read_slot_count = 0;
+  lock->read_slots = NULL;
+  lock->bias_type = ATBUILTIN_RWLOCK_BIAS_NONE;
+  lock->read_bias = 0;
+  lock->bias_inhibit_until = 0;
+  lock->queue_lock = 0;
+  lock->queue_order = ATBUILTIN_RWLOCK_QUEUE_ORDER_FIFO;
+  lock->queue_head = NULL;
+  lock->queue_tail = NULL;
+  lock->cohort_type = ATBUILTIN_RWLOCK_COHORT_NONE;
+  lock->cohort_batch = 0;
+  lock->cohort_node_count = 0;
+  lock->cohort_nodes = NULL;
+  lock->upgrade_node = NULL;
+  lock->write_batch_count = 0;
+  lock->write_batch_start = 0;
+  lock->read_max = 0;
+  lock->adaptive_type = 0;
+  lock->adaptive_ops = 0;
+  lock->adaptive_read_wait = 0;
+  lock->adaptive_write_wait = 0;
+  lock->adaptive_switches = 0;
+  lock->adaptive_streak = 0;
+  lock->adaptive_direction = 0;
+  lock->adaptive_reversals = 0;
+  lock->timedrlock = atbuiltin_rwlock_timedrlock_any_priority;
+  lock->rlock = atbuiltin_rwlock_rlock_any_priority;
+  if (attr)
+  {
+    lock->write_lock_interval = attr->write_lock_interval;
+    lock->write_wait_cap = attr->write_wait_cap;
+    lock->write_batch = attr->write_batch;
+    lock->write_batch_time = attr->write_batch_time;
+    lock->spin_type = attr->spin_attr;
+    if (lock->spin_type == ATBUILTIN_RWLOCK_SPIN_ADAPTIVE)
+    {
+      lock->mutex_spin_count = ATBUILTIN_RWLOCK_SPIN_LOOPS;
+      lock->drain_spin_count = ATBUILTIN_RWLOCK_SPIN_LOOPS;
+    }
+    lock->backoff_type = attr->backoff_attr;
+    priority = attr->rwlock_attr;
+    if (priority == ATBUILTIN_RWLOCK_ADAPTIVE)
+    {
+      /* queue waiters are served in arrival order without a priority */
+      if (attr->wait_attr != ATBUILTIN_RWLOCK_WAIT_QUEUE)
+      {
+        lock->adaptive_type = 1;
+        /* a writer starved by read priority has to get the lock to be sampled */
+        if (!lock->write_wait_cap)
+        {
+          lock->write_wait_cap = ATBUILTIN_RWLOCK_ADAPTIVE_WRITE_WAIT_CAP;
+        }
+      }
+      priority = ATBUILTIN_RWLOCK_READ_PRIORITY;
+    }
+    lock->lock_body = (atbuiltin_rwlock_state) priority <<
+      ATBUILTIN_RWLOCK_PRIORITY_SHIFT;
+    if (
+      attr->read_counter_attr == ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU ||
+      attr->bias_attr == ATBUILTIN_RWLOCK_BIAS_READ ||
+      attr->wait_attr == ATBUILTIN_RWLOCK_WAIT_QUEUE ||
+      attr->cohort_attr == ATBUILTIN_RWLOCK_COHORT_NUMA
+    ) {
+      /*
+        read_slots, atbuiltin_visible_readers, queue nodes and cohort nodes
+        are in this process only
+      */
+      if ((ret = pthread_condattr_getpshared(&attr->cond_attr, &pshared)))
+        goto error_read_slots_init;
+      if (pshared == PTHREAD_PROCESS_SHARED)
+      {
+        ret = EINVAL;
+        goto error_read_slots_init;
+      }
+    }
+    if (
+      attr->wait_attr == ATBUILTIN_RWLOCK_WAIT_PI &&
+      (ret = atbuiltin_pi_supported())
+    ) {
+      goto error_read_slots_init;
+    }
+    if (
+      attr->cohort_attr == ATBUILTIN_RWLOCK_COHORT_NUMA &&
+      (nodes = atbuiltin_numa_node_count()) > 1
+    ) {
+      /*
+        queue waiters do not take the cohort locks, busy-poll waiters do not
+        sleep on them, and the cohort locks do not hold the TID of the owner
+      */
+      if (
+        attr->wait_attr == ATBUILTIN_RWLOCK_WAIT_QUEUE ||
+        attr->wait_attr == ATBUILTIN_RWLOCK_WAIT_SPIN ||
+        attr->wait_attr == ATBUILTIN_RWLOCK_WAIT_PI
+      ) {
+        ret = EINVAL;
+        goto error_read_slots_init;
+      }
+      if ((ret = atbuiltin_read_slots_init(lock, nodes)))
+        goto error_read_slots_init;
+      if ((ret = atbuiltin_cohort_init(lock, nodes)))
+        goto error_cond_init;
+      lock->cohort_batch = attr->cohort_batch_attr;
+    } else if (
+      attr->read_counter_attr == ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU
+    ) {
+      if ((cpus = sysconf(_SC_NPROCESSORS_CONF)) < 1)
+        cpus = 1;
+      if ((ret = atbuiltin_read_slots_init(lock, (int) cpus)))
+        goto error_read_slots_init;
+    }
+    if (attr->bias_attr == ATBUILTIN_RWLOCK_BIAS_READ)
+    {
+      lock->bias_type = ATBUILTIN_RWLOCK_BIAS_READ;
+      lock->read_bias = 1;
+    }
+    if (attr->read_max)
+    {
+      /* read_slots, bias slots and queue grants are out of the reader count */
+      if (
+        lock->read_counter_type == ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU ||
+        attr->bias_attr == ATBUILTIN_RWLOCK_BIAS_READ ||
+        attr->wait_attr == ATBUILTIN_RWLOCK_WAIT_QUEUE
+      ) {
+        ret = EINVAL;
+        goto error_cond_init;
+      }
+      lock->read_max = attr->read_max;
+    }
+    atbuiltin_rwlock_set_priority(lock, priority);
+    if (
+      attr->wait_attr == ATBUILTIN_RWLOCK_WAIT_FUTEX ||
+      attr->wait_attr == ATBUILTIN_RWLOCK_WAIT_PI
+    ) {
+      lock->wait_type = attr->wait_attr;
+      if ((ret = pthread_condattr_getpshared(&attr->cond_attr, &pshared)))
+        goto error_cond_init;
+      if (pshared == PTHREAD_PROCESS_SHARED)
+        lock->futex_shared = 1;
+      return 0;
+    }
+    if (attr->wait_attr == ATBUILTIN_RWLOCK_WAIT_SPIN)
+    {
+      lock->wait_type = ATBUILTIN_RWLOCK_WAIT_SPIN;
+      lock->wait_spin_limit = attr->wait_spin_limit;
+      return 0;
+    }
+    if (attr->wait_attr == ATBUILTIN_RWLOCK_WAIT_QUEUE)
+    {
+      lock->wait_type = ATBUILTIN_RWLOCK_WAIT_QUEUE;
+      lock->queue_order = attr->queue_order_attr;
+      lock->timedrlock = atbuiltin_rwlock_timedrlock_queue;
+      lock->rlock = atbuiltin_rwlock_rlock_queue;
+      lock->timedwlock = atbuiltin_rwlock_timedwlock_queue;
+      lock->wlock = atbuiltin_rwlock_wlock_queue;
+      lock->wunlock = atbuiltin_rwlock_wunlock_queue;
+      return 0;
+    }
+    if ((ret = pthread_cond_init(&lock->cond, &attr->cond_attr)))
+      goto error_cond_init;
+    if ((ret = pthread_mutex_init(&lock->mutex, &attr->mutex_attr)))
+      goto error_mutex_init;
+    if ((ret = pthread_mutex_init(&lock->cond_mutex, &attr->mutex_attr)))
+      goto error_cond_mutex_init;
+    lock->wait_setup = ATBUILTIN_RWLOCK_WAIT_SETUP_DONE;
+  } else {
+    lock->write_lock_interval = 0;
+    lock->write_wait_cap = 0;
+    lock->write_batch = 0;
+    lock->write_batch_time = 0;
+    atbuiltin_rwlock_set_priority(lock, ATBUILTIN_RWLOCK_READ_PRIORITY);
+    /* mutex, cond_mutex and cond are initialized by atbuiltin_wait_setup */
+  }
+  return 0;
+
+error_cond_mutex_init:
+  pthread_mutex_destroy(&lock->mutex);
+error_mutex_init:
+  pthread_cond_destroy(&lock->cond);
+error_cond_init:
+  free(lock->cohort_nodes);
+  free(lock->read_slots);
+error_read_slots_init:
+  return ret;
+}
+
+int atbuiltin_rwlock_destroy(atbuiltin_rwlock_t *lock)
+{
+  int ret1, ret2, ret3;
+  free(lock->read_slots);
+  lock->read_slots = NULL;
+  free(lock->cohort_nodes);
+  lock->cohort_nodes = NULL;
+  if (
+    lock->wait_type != ATBUILTIN_RWLOCK_WAIT_PTHREAD ||
+    lock->wait_setup != ATBUILTIN_RWLOCK_WAIT_SETUP_DONE
+  ) {
+    return 0;
+  }
+  lock->wait_setup = ATBUILTIN_RWLOCK_WAIT_SETUP_NONE;
+  ret1 = pthread_cond_destroy(&lock->cond);
+  ret2 = pthread_mutex_destroy(&lock->mutex);
+  ret3 = pthread_mutex_destroy(&lock->cond_mutex);
+  if (ret1)
+    return ret1;
+  if (ret2)
+    return ret2;
+  return ret3;
+}
+
+int atbuiltin_rwlock_tryrlock(atbuiltin_rwlock_t *lock)
+{
+  return atbuiltin_rwlock_read_trylock(lock);
+}
+
+/*
+int atbuiltin_rwlock_timedrlock(atbuiltin_rwlock_t *lock, const struct timespec *timeout)
+{
+  return lock->timedrlock(lock, timeout, ATBUILTIN_RWLOCK_TIMEOUT_RELATIVE);
+}
+
+int atbuiltin_rwlock_rlock(atbuiltin_rwlock_t *lock)
+{
+  return lock->rlock(lock);
+}
+*/
+
+static inline bool atbuiltin_clock_invalid(clockid_t clockid, const struct timespec *abstime)
+{
+  return
+    (clockid != CLOCK_MONOTONIC && clockid != CLOCK_REALTIME) ||
+    abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000;
+}
+
+int atbuiltin_rwlock_clockrlock(atbuiltin_rwlock_t *lock, clockid_t clockid, const struct timespec *abstime)
+{
+  if (atbuiltin_clock_invalid(clockid, abstime))
+  {
+    return EINVAL;
+  }
+  if (!lock->timedrlock)
+  {
+    return atbuiltin_rwlock_static_timedrlock(lock, abstime, clockid);
+  }
+  return lock->timedrlock(lock, abstime, clockid);
+}
+
+int atbuiltin_rwlock_runlock(atbuiltin_rwlock_t *lock)
+{
+  atbuiltin_rwlock_read_exit(lock);
+  return 0;
+}
+
+/*
+  Optimistic readers never write to the lock. read_begin returns EBUSY while
+  a writer holds the lock, and read_validate returns EBUSY when a writer got
+  the lock after read_begin, so the caller reads again or takes the read lock.
+*/
+int atbuiltin_rwlock_read_begin(atbuiltin_rwlock_t *lock, unsigned int *seq)
+{
+  *seq = atbuiltin_write_seq_load(lock);
+  atbuiltin_thread_fence(ATBUILTIN_RWLOCK_ACQUIRE);
+  return (*seq & 1) ? EBUSY : 0;
+}
+
+int atbuiltin_rwlock_read_validate(atbuiltin_rwlock_t *lock, unsigned int seq)
+{
+  atbuiltin_thread_fence(ATBUILTIN_RWLOCK_ACQUIRE);
+  return atbuiltin_write_seq_load(lock) == seq ? 0 : EBUSY;
+}
+
+int atbuiltin_rwlock_trywlock(atbuiltin_rwlock_t *lock)
+{
+  int res;
+  if (lock->wait_type == ATBUILTIN_RWLOCK_WAIT_QUEUE)
+  {
+    res = atbuiltin_queue_write_trylock(lock);
+  } else {
+    res = atbuiltin_rwlock_write_trylock(lock);
+  }
+  if (res)
+  {
+    return res;
+  }
+  if ((res = atbuiltin_bias_revoke(lock, true, NULL)))
+  {
+    atbuiltin_rwlock_wunlock(lock);
+    return res;
+  }
+  /* lock success */
+  return 0;
+}
+
+/*
+int atbuiltin_rwlock_timedwlock(atbuiltin_rwlock_t *lock, const struct timespec *timeout)
+{
+  return lock->timedwlock(lock, timeout, ATBUILTIN_RWLOCK_TIMEOUT_RELATIVE);
+}
+
+int atbuiltin_rwlock_wlock(atbuiltin_rwlock_t *lock)
+{
+  return lock->wlock(lock);
+}
+
+int atbuiltin_rwlock_wunlock(atbuiltin_rwlock_t *lock)
+{
+  return lock->wunlock(lock);
+}
+*/
+
+/*
+  A lock from ATBUILTIN_RWLOCK_INITIALIZER is same as a lock which
+  atbuiltin_rwlock_init initialized without attr, but its function pointers
+  are NULL. The macros call these functions for it instead.
+*/
+int atbuiltin_rwlock_static_timedrlock(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid)
+{
+  return atbuiltin_rwlock_timedrlock_any_priority(lock, timeout, clockid);
+}
+
+int atbuiltin_rwlock_static_rlock(atbuiltin_rwlock_t *lock)
+{
+  return atbuiltin_rwlock_rlock_any_priority(lock);
+}
+
+int atbuiltin_rwlock_static_timedwlock(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid)
+{
+  return atbuiltin_rwlock_timedwlock_read_priority(lock, timeout, clockid);
+}
+
+int atbuiltin_rwlock_static_wlock(atbuiltin_rwlock_t *lock)
+{
+  return atbuiltin_rwlock_wlock_read_priority(lock);
+}
+
+int atbuiltin_rwlock_static_wunlock(atbuiltin_rwlock_t *lock)
+{
+  return atbuiltin_rwlock_wunlock_read_priority(lock);
+}
+
+int atbuiltin_rwlock_clockwlock(atbuiltin_rwlock_t *lock, clockid_t clockid, const struct timespec *abstime)
+{
+  if (atbuiltin_clock_invalid(clockid, abstime))
+  {
+    return EINVAL;
+  }
+  if (!lock->timedwlock)
+  {
+    return atbuiltin_rwlock_static_timedwlock(lock, abstime, clockid);
+  }
+  return lock->timedwlock(lock, abstime, clockid);
+}
+
+/*
+  An upgradeable reader holds the writer lock, which keeps other upgradeable
+  readers out and lets it become a writer later without waiting for another
+  writer, and is counted as a reader in lock_body. Writers which do not take
+  the writer lock are only those which took the lock by the CAS fast path, so
+  this waits for such a writer while it is counted as a writer to be woken up
+  by atbuiltin_rwlock_write_exit, and then becomes a reader in the same CAS.
+  WRITE_WAITING which the fast path writer left for this is cleared here.
+*/
+static inline int atbuiltin_rwlock_upgrade_enter(atbuiltin_rwlock_t *lock, const struct timespec *abstime)
+{
+  int res;
+  unsigned long long int cnt = 0;
+  atbuiltin_rwlock_state state, new_state;
+  atbuiltin_add_and_fetch(&lock->lock_body, ATBUILTIN_RWLOCK_WRITER_ONE,
+    ATBUILTIN_RWLOCK_RELAXED);
+  while (true)
+  {
+    state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED);
+    if (!(state & ATBUILTIN_RWLOCK_WRITE_LOCKED))
     {
-      atbuiltin_sub_and_fetch(&lock->tr_waiter_count, 1, ATBUILTIN_RWLOCK_RELAXED);
-      return ETIMEDOUT;
+      new_state = state - ATBUILTIN_RWLOCK_WRITER_ONE +
+        ATBUILTIN_RWLOCK_READER_ONE;
+      if (!(new_state & ATBUILTIN_RWLOCK_WRITER_MASK))
+      {
+        new_state &= ~ATBUILTIN_RWLOCK_WRITE_WAITING;
+      }
+      if (atbuiltin_compare_and_swap_n(&lock->lock_body, &state, new_state,
+        ATBUILTIN_RWLOCK_CAS_WEAK, ATBUILTIN_RWLOCK_ACQUIRE,
+        ATBUILTIN_RWLOCK_RELAXED))
+      {
+        if (
+          (state & ATBUILTIN_RWLOCK_READ_WAITER_MASK) &&
+          atbuiltin_rwlock_read_blocked(state) &&
+          !atbuiltin_rwlock_read_blocked(new_state)
+        ) {
+          atbuiltin_wake_readers(lock);
+        }
+        /* lock success */
+        return 0;
+      }
+      continue;
+    }
+    if (lock->wait_type == ATBUILTIN_RWLOCK_WAIT_SPIN)
+    {
+      if ((res = atbuiltin_busy_wait(lock, &cnt, abstime)))
+      {
+        break;
+      }
+      continue;
+    }
+    res = 0;
+    atbuiltin_exchange_n(&lock->drain_waiting, 1, ATBUILTIN_RWLOCK_SEQ_CST);
+    if (atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_SEQ_CST) &
+      ATBUILTIN_RWLOCK_WRITE_LOCKED)
+    {
+      res = atbuiltin_futex_wait(&lock->drain_waiting, 1, abstime,
+        atbuiltin_futex_flag(lock));
+    }
+    atbuiltin_exchange_n(&lock->drain_waiting, 0, ATBUILTIN_RWLOCK_RELAXED);
+    if (res == ETIMEDOUT)
+    {
+      break;
+    }
+  }
+  atbuiltin_rwlock_write_exit(lock,
+    (int) (state >> ATBUILTIN_RWLOCK_PRIORITY_SHIFT), false);
+  return res;
+}
+
+/*
+  With ATBUILTIN_RWLOCK_WAIT_QUEUE, writers do not take the writer lock, so
+  upgradeable readers are not supported.
+*/
+int atbuiltin_rwlock_tryulock(atbuiltin_rwlock_t *lock)
+{
+  int res;
+  struct timespec ts = {0, 0};
+  atbuiltin_rwlock_cohort_node_t *node = NULL;
+  if (lock->wait_type == ATBUILTIN_RWLOCK_WAIT_QUEUE)
+  {
+    return EINVAL;
+  }
+  if (lock->cohort_type == ATBUILTIN_RWLOCK_COHORT_NUMA)
+  {
+    if (atbuiltin_cohort_timedlock(lock, &node, &ts))
+    {
+      return EBUSY;
+    }
+  } else if ((res = atbuiltin_mutex_trylock(lock))) {
+    return res;
+  }
+  if ((res = atbuiltin_rwlock_upgrade_enter(lock, &ts)))
+  {
+    atbuiltin_writer_unlock(lock, node);
+    return EBUSY;
+  }
+  lock->upgrade_node = node;
+  /* lock success */
+  return 0;
+}
+
+int atbuiltin_rwlock_timedulock(atbuiltin_rwlock_t *lock, const struct timespec *timeout)
+{
+  int res;
+  struct timespec abstime;
+  atbuiltin_rwlock_cohort_node_t *node = NULL;
+  if (lock->wait_type == ATBUILTIN_RWLOCK_WAIT_QUEUE)
+  {
+    return EINVAL;
+  }
+  atbuiltin_deadline_init(&abstime, NULL, timeout,
+    ATBUILTIN_RWLOCK_TIMEOUT_RELATIVE);
+  if ((res = atbuiltin_writer_timedlock(lock, &node, &abstime)))
+  {
+    return res;
+  }
+  if ((res = atbuiltin_rwlock_upgrade_enter(lock, &abstime)))
+  {
+    atbuiltin_writer_unlock(lock, node);
+    return res;
+  }
+  lock->upgrade_node = node;
+  /* lock success */
+  return 0;
+}
+
+int atbuiltin_rwlock_ulock(atbuiltin_rwlock_t *lock)
+{
+  int res;
+  atbuiltin_rwlock_cohort_node_t *node = NULL;
+  if (lock->wait_type == ATBUILTIN_RWLOCK_WAIT_QUEUE)
+  {
+    return EINVAL;
+  }
+  if ((res = atbuiltin_writer_timedlock(lock, &node, NULL)))
+  {
+    return res;
+  }
+  if ((res = atbuiltin_rwlock_upgrade_enter(lock, NULL)))
+  {
+    atbuiltin_writer_unlock(lock, node);
+    return res;
+  }
+  lock->upgrade_node = node;
+  /* lock success */
+  return 0;
+}
+
+int atbuiltin_rwlock_uunlock(atbuiltin_rwlock_t *lock)
+{
+  atbuiltin_read_body_exit(lock);
+  atbuiltin_writer_unlock(lock, lock->upgrade_node);
+  return 0;
+}
+
+/*
+  The reader count of the upgradeable reader is turned into a writer in one
+  atomic add, and the writer lock is kept until no reader is left, so no
+  other writer gets the lock in between. If it fails, the caller is still an
+  upgradeable reader.
+*/
+int atbuiltin_rwlock_upgrade(atbuiltin_rwlock_t *lock)
+{
+  int res, priority;
+  priority = (int) (atbuiltin_add_and_fetch(&lock->lock_body,
+    ATBUILTIN_RWLOCK_WRITER_ONE - ATBUILTIN_RWLOCK_READER_ONE,
+    ATBUILTIN_RWLOCK_RELAXED) >> ATBUILTIN_RWLOCK_PRIORITY_SHIFT);
+  if ((res = atbuiltin_rwlock_write_drain(lock, priority, NULL)))
+  {
+    atbuiltin_add_and_fetch(&lock->lock_body, ATBUILTIN_RWLOCK_READER_ONE,
+      ATBUILTIN_RWLOCK_RELAXED);
+    atbuiltin_rwlock_write_exit(lock, priority, false);
+    return res;
+  }
+  if ((res = atbuiltin_bias_revoke(lock, false, NULL)))
+  {
+    atbuiltin_add_and_fetch(&lock->lock_body, ATBUILTIN_RWLOCK_READER_ONE,
+      ATBUILTIN_RWLOCK_RELAXED);
+    atbuiltin_rwlock_write_exit(lock, priority, true);
+    return res;
+  }
+  atbuiltin_writer_unlock(lock, lock->upgrade_node);
+  /* lock success */
+  return 0;
+}
+
+/*
+  The writer is counted as a reader before it releases the lock, so the next
+  writer waits for it. With per-CPU read counters it moves itself to its slot
+  after that.
+*/
+int atbuiltin_rwlock_downgrade(atbuiltin_rwlock_t *lock)
+{
+  atbuiltin_add_and_fetch(&lock->lock_body, ATBUILTIN_RWLOCK_READER_ONE,
+    ATBUILTIN_RWLOCK_RELAXED);
+  atbuiltin_rwlock_wunlock(lock);
+  atbuiltin_rwlock_read_granted(lock);
+  return 0;
+}
+
+int atbuiltin_rwlock_backoff_init(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_backoff_t *backoff)
+{
+  backoff->count = 0;
+  backoff->spin_steps = 0;
+  backoff->sleeps = 0;
+  backoff->sleep_nsec = 0;
+  backoff->seed = (unsigned int) (((unsigned long) backoff ^
+    (unsigned long) lock) >> 4) | 1;
+  return 0;
+}
+
+int atbuiltin_rwlock_backoff(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_backoff_t *backoff)
+{
+  struct timespec ts;
+  if (atbuiltin_backoff_step(lock, backoff, &ts))
+  {
+    nanosleep(&ts, NULL);
+  }
+  return 0;
+}
+
+int atbuiltin_rwlock_backoff_destroy(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_backoff_t *backoff)
+{
+  if (backoff->spin_steps)
+  {
+    atbuiltin_add_and_fetch(&lock->backoff_spin_steps, backoff->spin_steps,
+      ATBUILTIN_RWLOCK_RELAXED);
+  }
+  if (backoff->sleeps)
+  {
+    atbuiltin_add_and_fetch(&lock->backoff_sleeps, backoff->sleeps,
+      ATBUILTIN_RWLOCK_RELAXED);
+    atbuiltin_add_and_fetch(&lock->backoff_sleep_nsec, backoff->sleep_nsec,
+      ATBUILTIN_RWLOCK_RELAXED);
+  }
+  return 0;
+}
+
+int atbuiltin_rwlock_getstat_backoff(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_backoff_stat_t *stat)
+{
+  stat->spin_steps = atbuiltin_load_n(&lock->backoff_spin_steps,
+    ATBUILTIN_RWLOCK_RELAXED);
+  stat->sleeps = atbuiltin_load_n(&lock->backoff_sleeps,
+    ATBUILTIN_RWLOCK_RELAXED);
+  stat->sleep_nsec = atbuiltin_load_n(&lock->backoff_sleep_nsec,
+    ATBUILTIN_RWLOCK_RELAXED);
+  return 0;
+}
+
+int atbuiltin_rwlock_getstat_adaptive(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_adaptive_stat_t *stat)
+{
+  stat->priority = (int) (atbuiltin_load_n(&lock->lock_body,
+    ATBUILTIN_RWLOCK_RELAXED) >> ATBUILTIN_RWLOCK_PRIORITY_SHIFT);
+  stat->switches = atbuiltin_load_n(&lock->adaptive_switches,
+    ATBUILTIN_RWLOCK_RELAXED);
+  return 0;
+}
+
+/*
+  Readers which wait for the old limit are woken up to check the new one.
+*/
+int atbuiltin_rwlock_set_read_max(atbuiltin_rwlock_t *lock, unsigned int max)
+{
+  if (max > ATBUILTIN_RWLOCK_READER_MASK)
+    return EINVAL;
+  if (
+    max &&
+    (
+      lock->read_counter_type == ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU ||
+      lock->bias_type == ATBUILTIN_RWLOCK_BIAS_READ ||
+      lock->wait_type == ATBUILTIN_RWLOCK_WAIT_QUEUE
+    )
+  ) {
+    return EINVAL;
+  }
+  atbuiltin_store_n(&lock->read_max, max, ATBUILTIN_RWLOCK_SEQ_CST);
+  if (atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_SEQ_CST) &
+    ATBUILTIN_RWLOCK_READ_WAITER_MASK)
+  {
+    atbuiltin_wake_readers(lock);
+  }
+  return 0;
+}
+
+int atbuiltin_rwlock_get_read_max(atbuiltin_rwlock_t *lock, unsigned int *max)
+{
+  *max = atbuiltin_load_n(&lock->read_max, ATBUILTIN_RWLOCK_RELAXED);
+  return 0;
+}
+
+/*
+  Drops a waiting reader from lock_body. Returns false when a writer has
+  already given the lock to the reader by flipping READ_PHASE.
+*/
+static inline bool atbuiltin_rwlock_read_unwait(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_state phase)
+{
+  atbuiltin_rwlock_state state;
+  do {
+    state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED);
+    if ((state & ATBUILTIN_RWLOCK_READ_PHASE) != phase)
+    {
+      atbuiltin_thread_fence(ATBUILTIN_RWLOCK_ACQUIRE);
+      return false;
+    }
+  } while (!atbuiltin_compare_and_swap_n(&lock->lock_body, &state,
+    state - ATBUILTIN_RWLOCK_READ_WAITER_ONE, ATBUILTIN_RWLOCK_CAS_WEAK,
+    ATBUILTIN_RWLOCK_RELAXED, ATBUILTIN_RWLOCK_RELAXED));
+  return true;
+}
+
+/*
+  A reader which a writer gave the lock to is counted in lock_body. With
+  per-CPU read counters it moves itself to its slot.
+*/
+static inline void atbuiltin_rwlock_read_granted(atbuiltin_rwlock_t *lock)
+{
+  if (lock->read_counter_type == ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU)
+  {
+    atbuiltin_add_and_fetch(&atbuiltin_read_slot(lock)->readers, 1,
+      ATBUILTIN_RWLOCK_SEQ_CST);
+    atbuiltin_read_body_exit(lock);
+  }
+}
+
+/*
+  Waits once for the writer which blocks this reader. Returns ETIMEDOUT,
+  EBUSY or the error of the wait when the reader gives up.
+*/
+static inline int atbuiltin_rwlock_read_wait(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_state phase, const struct timespec *abstime, unsigned long long int *cnt)
+{
+  if (lock->wait_type == ATBUILTIN_RWLOCK_WAIT_SPIN)
+  {
+    return atbuiltin_busy_wait(lock, cnt, abstime);
+  }
+  if (!abstime)
+  {
+    return atbuiltin_wait_writer(lock, phase);
+  }
+  return atbuiltin_timedwait_writer(lock, phase, abstime);
+}
+
+static inline int atbuiltin_rwlock_rlock_common(atbuiltin_rwlock_t *lock, const struct timespec *abstime)
+{
+  int res;
+  unsigned long long int cnt = 0;
+  atbuiltin_rwlock_state state, phase;
+  state = atbuiltin_add_and_fetch(&lock->lock_body,
+    ATBUILTIN_RWLOCK_READ_WAITER_ONE, ATBUILTIN_RWLOCK_RELAXED);
+  phase = state & ATBUILTIN_RWLOCK_READ_PHASE;
+  while (true)
+  {
+    if ((state & ATBUILTIN_RWLOCK_READ_PHASE) != phase)
+    {
+      atbuiltin_thread_fence(ATBUILTIN_RWLOCK_ACQUIRE);
+      atbuiltin_rwlock_read_granted(lock);
+      /* lock success */
+      return 0;
+    }
+    if (
+      !atbuiltin_rwlock_read_blocked(state) &&
+      !atbuiltin_rwlock_read_full(lock, state)
+    ) {
+      if (lock->read_counter_type == ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU)
+      {
+        if (!atbuiltin_read_slot_trylock(lock))
+        {
+          if (!atbuiltin_rwlock_read_unwait(lock, phase))
+          {
+            atbuiltin_read_body_exit(lock);
+          }
+          /* lock success */
+          return 0;
+        }
+      } else if (atbuiltin_compare_and_swap_n(&lock->lock_body, &state,
+        state - ATBUILTIN_RWLOCK_READ_WAITER_ONE + ATBUILTIN_RWLOCK_READER_ONE,
+        ATBUILTIN_RWLOCK_CAS_WEAK, ATBUILTIN_RWLOCK_ACQUIRE,
+        ATBUILTIN_RWLOCK_RELAXED))
+      {
+        /* lock success */
+        return 0;
+      }
+    } else if ((res = atbuiltin_rwlock_read_wait(lock, phase, abstime, &cnt))) {
+      break;
     }
-    if ((res = pthread_mutex_timedlock(&lock->mutex, &tsr)))
+    state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED);
+  }
+  if (!atbuiltin_rwlock_read_unwait(lock, phase))
+  {
+    atbuiltin_rwlock_read_granted(lock);
+    /* lock success */
+    return 0;
+  }
+  return res;
+}
+
+static int atbuiltin_rwlock_timedrlock_any_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid)
+{
+  int res;
+  struct timespec tss, abstime;
+  if (!atbuiltin_rwlock_read_trylock(lock))
+  {
+    atbuiltin_adaptive_sample(lock, false, NULL);
+    /* lock success */
+    return 0;
+  }
+  atbuiltin_deadline_init(&abstime, lock->adaptive_type ? &tss : NULL,
+    timeout, clockid);
+  if ((res = atbuiltin_rwlock_rlock_common(lock, &abstime)))
+  {
+    return res;
+  }
+  atbuiltin_adaptive_sample(lock, false, &tss);
+  /* lock success */
+  return 0;
+}
+
+static int atbuiltin_rwlock_rlock_any_priority(atbuiltin_rwlock_t *lock)
+{
+  int res;
+  struct timespec tss;
+  if (!atbuiltin_rwlock_read_trylock(lock))
+  {
+    atbuiltin_adaptive_sample(lock, false, NULL);
+    /* lock success */
+    return 0;
+  }
+  if (lock->adaptive_type)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &tss);
+  }
+  if ((res = atbuiltin_rwlock_rlock_common(lock, NULL)))
+  {
+    return res;
+  }
+  atbuiltin_adaptive_sample(lock, false, &tss);
+  /* lock success */
+  return 0;
+}
+
+static inline int atbuiltin_rwlock_timedwlock_common(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid, int priority)
+{
+  int res;
+  struct timespec tss, abstime;
+  const struct timespec *tsw = NULL;
+  atbuiltin_rwlock_cohort_node_t *node = NULL;
+  atbuiltin_deadline_init(&abstime, lock->adaptive_type ? &tss : NULL,
+    timeout, clockid);
+  if (atbuiltin_rwlock_write_trylock(lock))
+  {
+    tsw = &tss;
+    if ((res = atbuiltin_writer_timedlock(lock, &node, &abstime)))
     {
-      atbuiltin_sub_and_fetch(&lock->tr_waiter_count, 1, ATBUILTIN_RWLOCK_RELAXED);
       return res;
     }
-    if (lock->write_waiting)
+    atbuiltin_add_and_fetch(&lock->lock_body, ATBUILTIN_RWLOCK_WRITER_ONE,
+      ATBUILTIN_RWLOCK_RELAXED);
+    res = atbuiltin_rwlock_write_drain(lock, priority, &abstime);
+    atbuiltin_writer_unlock(lock, node);
+    if (res)
     {
-      clock_gettime(CLOCK_MONOTONIC, &tsc);
-      if (timespec_sub(&tsr, &tss, &tsc))
-      {
-        pthread_mutex_unlock(&lock->mutex);
-        atbuiltin_sub_and_fetch(&lock->tr_waiter_count, 1, ATBUILTIN_RWLOCK_RELAXED);
-        return ETIMEDOUT;
-      }
-      if ((res = pthread_cond_timedwait(&lock->cond, &lock->mutex, &tsr)))
-      {
-        if (res == ETIMEDOUT)
-        {
-          pthread_mutex_unlock(&lock->mutex);
-          atbuiltin_sub_and_fetch(&lock->tr_waiter_count, 1, ATBUILTIN_RWLOCK_RELAXED);
-          return ETIMEDOUT;
-        }
-      }
+      atbuiltin_rwlock_write_exit(lock, priority, false);
+      return res;
     }
-    pthread_mutex_unlock(&lock->mutex);
   }
-  while (true)
+  if ((res = atbuiltin_bias_revoke(lock, false, &abstime)))
+  {
+    atbuiltin_rwlock_write_exit(lock, priority, true);
+    return res;
+  }
+  atbuiltin_adaptive_sample(lock, true, tsw);
+  /* lock success */
+  return 0;
+}
+
+/*
+  Only waits of ATBUILTIN_RWLOCK_WAIT_SPIN with wait_spin_limit and failures
+  of FUTEX_LOCK_PI with ATBUILTIN_RWLOCK_WAIT_PI fail here.
+*/
+static inline int atbuiltin_rwlock_wlock_common(atbuiltin_rwlock_t *lock, int priority)
+{
+  int res;
+  struct timespec tss;
+  const struct timespec *tsw = NULL;
+  atbuiltin_rwlock_cohort_node_t *node = NULL;
+  if (atbuiltin_rwlock_write_trylock(lock))
   {
-    cnt = atbuiltin_add_and_fetch(&lock->lock_body, 1, ATBUILTIN_RWLOCK_ACQUIRE);
-    if (cnt > 0)
+    if (lock->adaptive_type)
     {
-      atbuiltin_sub_and_fetch(&lock->tr_waiter_count, 1, ATBUILTIN_RWLOCK_RELAXED);
-      /* lock success */
-      return 0;
+      clock_gettime(CLOCK_MONOTONIC, &tss);
+      tsw = &tss;
     }
-    atbuiltin_sub_and_fetch(&lock->lock_body, 1, ATBUILTIN_RWLOCK_RELAXED);
-    clock_gettime(CLOCK_MONOTONIC, &tsc);
-    if (timespec_sub(&tsr, &tss, &tsc))
+    atbuiltin_add_and_fetch(&lock->lock_body, ATBUILTIN_RWLOCK_WRITER_ONE,
+      ATBUILTIN_RWLOCK_RELAXED);
+    if ((res = atbuiltin_writer_timedlock(lock, &node, NULL)))
     {
-      atbuiltin_sub_and_fetch(&lock->tr_waiter_count, 1,
-        ATBUILTIN_RWLOCK_RELAXED);
-      return ETIMEDOUT;
+      atbuiltin_rwlock_write_exit(lock, priority, false);
+      return res;
     }
-    if ((res = pthread_mutex_timedlock(&lock->mutex, &tsr)))
+    res = atbuiltin_rwlock_write_drain(lock, priority, NULL);
+    atbuiltin_writer_unlock(lock, node);
+    if (res)
     {
-      atbuiltin_sub_and_fetch(&lock->tr_waiter_count, 1,
-        ATBUILTIN_RWLOCK_RELAXED);
+      atbuiltin_rwlock_write_exit(lock, priority, false);
       return res;
     }
-    if (lock->write_waiting)
-    {
-      clock_gettime(CLOCK_MONOTONIC, &tsc);
-      if (timespec_sub(&tsr, &tss, &tsc))
-      {
-        pthread_mutex_unlock(&lock->mutex);
-        atbuiltin_sub_and_fetch(&lock->tr_waiter_count, 1,
-          ATBUILTIN_RWLOCK_RELAXED);
-        return ETIMEDOUT;
-      }
-      if ((res = pthread_cond_timedwait(&lock->cond, &lock->mutex, &tsr)))
+  }
+  if ((res = atbuiltin_bias_revoke(lock, false, NULL)))
+  {
+    atbuiltin_rwlock_write_exit(lock, priority, true);
+    return res;
+  }
+  atbuiltin_adaptive_sample(lock, true, tsw);
+  /* lock success */
+  return 0;
+}
+
+static int atbuiltin_rwlock_timedwlock_read_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid)
+{
+  return atbuiltin_rwlock_timedwlock_common(lock, timeout, clockid,
+    ATBUILTIN_RWLOCK_READ_PRIORITY);
+}
+
+static int atbuiltin_rwlock_wlock_read_priority(atbuiltin_rwlock_t *lock)
+{
+  return atbuiltin_rwlock_wlock_common(lock, ATBUILTIN_RWLOCK_READ_PRIORITY);
+}
+
+static int atbuiltin_rwlock_wunlock_read_priority(atbuiltin_rwlock_t *lock)
+{
+  atbuiltin_rwlock_write_exit(lock, ATBUILTIN_RWLOCK_READ_PRIORITY, true);
+  /* unlock success */
+  return 0;
+}
+
+static int atbuiltin_rwlock_timedwlock_no_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid)
+{
+  return atbuiltin_rwlock_timedwlock_common(lock, timeout, clockid,
+    ATBUILTIN_RWLOCK_NO_PRIORITY);
+}
+
+static int atbuiltin_rwlock_wlock_no_priority(atbuiltin_rwlock_t *lock)
+{
+  return atbuiltin_rwlock_wlock_common(lock, ATBUILTIN_RWLOCK_NO_PRIORITY);
+}
+
+static int atbuiltin_rwlock_wunlock_no_priority(atbuiltin_rwlock_t *lock)
+{
+  atbuiltin_rwlock_write_exit(lock, ATBUILTIN_RWLOCK_NO_PRIORITY, true);
+  /* unlock success */
+  return 0;
+}
+
+static int atbuiltin_rwlock_timedwlock_write_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid)
+{
+  return atbuiltin_rwlock_timedwlock_common(lock, timeout, clockid,
+    ATBUILTIN_RWLOCK_WRITE_PRIORITY);
+}
+
+static int atbuiltin_rwlock_wlock_write_priority(atbuiltin_rwlock_t *lock)
+{
+  return atbuiltin_rwlock_wlock_common(lock, ATBUILTIN_RWLOCK_WRITE_PRIORITY);
+}
+
+static int atbuiltin_rwlock_wunlock_write_priority(atbuiltin_rwlock_t *lock)
+{
+  atbuiltin_rwlock_write_exit(lock, ATBUILTIN_RWLOCK_WRITE_PRIORITY, true);
+  /* unlock success */
+  return 0;
+}
+
+static int atbuiltin_rwlock_timedwlock_phase_fair(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid)
+{
+  return atbuiltin_rwlock_timedwlock_common(lock, timeout, clockid,
+    ATBUILTIN_RWLOCK_PHASE_FAIR);
+}
+
+static int atbuiltin_rwlock_wlock_phase_fair(atbuiltin_rwlock_t *lock)
+{
+  return atbuiltin_rwlock_wlock_common(lock, ATBUILTIN_RWLOCK_PHASE_FAIR);
+}
+
+static int atbuiltin_rwlock_wunlock_phase_fair(atbuiltin_rwlock_t *lock)
+{
+  atbuiltin_rwlock_write_exit(lock, ATBUILTIN_RWLOCK_PHASE_FAIR, true);
+  /* unlock success */
+  return 0;
+}
+
+/*
+  Queue wait type. Waiters line up in FIFO order in a list of nodes on their
+  own stacks, and each waiter spins and sleeps on the state of its own node.
+  queue_lock protects the list only, so a timed waiter can unlink its node at
+  any place of the list, and no other thread touches a node after it is
+  unlinked. WRITE_WAITING in lock_body is set while the list is not empty, so
+  that new readers and writers line up behind the waiters. Only the head of
+  the list waits for the lock itself, on drain_waiting. A reader at the head
+  takes the lock together with the readers which follow it, and the next node
+  becomes the head.
+  With QUEUE_ORDER_DEADLINE a new node is sorted into the list behind the head
+  by the absolute end of its timeout instead, and waiters without a timeout
+  keep arrival order at the end. The head is already waiting for the lock, so
+  it is never passed, and readers are still granted together only while no
+  writer with an earlier deadline is between them.
+*/
+#define ATBUILTIN_RWLOCK_QUEUE_WAITING 0
+#define ATBUILTIN_RWLOCK_QUEUE_SLEEPING 1
+#define ATBUILTIN_RWLOCK_QUEUE_GRANTED 2
+#define ATBUILTIN_RWLOCK_QUEUE_HEAD 3
+#define ATBUILTIN_RWLOCK_QUEUE_GRANT_MAX 16
+/* times a node checks for a grant or the lock before it sleeps */
+#define ATBUILTIN_RWLOCK_QUEUE_SPIN_MAX 100
+struct atbuiltin_rwlock_queue_node_t
+{
+  int state;
+  bool writer;
+  unsigned long long int deadline;
+  atbuiltin_rwlock_queue_node_t *prev;
+  atbuiltin_rwlock_queue_node_t *next;
+} __attribute__((aligned(ATBUILTIN_RWLOCK_CACHE_LINE_SIZE)));
+
+static inline void atbuiltin_queue_lock(atbuiltin_rwlock_t *lock)
+{
+  int cnt = 0;
+  while (atbuiltin_exchange_n(&lock->queue_lock, 1, ATBUILTIN_RWLOCK_ACQUIRE))
+  {
+    do {
+      if (cnt < ATBUILTIN_RWLOCK_SPIN_LOOPS)
       {
-        if (res == ETIMEDOUT)
-        {
-          pthread_mutex_unlock(&lock->mutex);
-          atbuiltin_sub_and_fetch(&lock->tr_waiter_count, 1,
-            ATBUILTIN_RWLOCK_RELAXED);
-          return ETIMEDOUT;
-        }
+        cnt++;
+        atbuiltin_cpu_relax();
+      } else {
+        sched_yield();
       }
+    } while (atbuiltin_load_n(&lock->queue_lock, ATBUILTIN_RWLOCK_RELAXED));
+  }
+}
+
+static inline void atbuiltin_queue_unlock(atbuiltin_rwlock_t *lock)
+{
+  atbuiltin_store_n(&lock->queue_lock, 0, ATBUILTIN_RWLOCK_RELEASE);
+}
+
+static inline void atbuiltin_queue_set_waiting(atbuiltin_rwlock_t *lock, bool waiting)
+{
+  atbuiltin_rwlock_state state;
+  do {
+    state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED);
+  } while (!atbuiltin_compare_and_swap_n(&lock->lock_body, &state,
+    waiting ? state | ATBUILTIN_RWLOCK_WRITE_WAITING :
+    state & ~ATBUILTIN_RWLOCK_WRITE_WAITING, ATBUILTIN_RWLOCK_CAS_WEAK,
+    ATBUILTIN_RWLOCK_SEQ_CST, ATBUILTIN_RWLOCK_RELAXED));
+}
+
+static inline void atbuiltin_queue_push(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_queue_node_t *node, bool writer, unsigned long long int deadline)
+{
+  node->writer = writer;
+  node->deadline = deadline;
+  atbuiltin_queue_lock(lock);
+  node->prev = lock->queue_tail;
+  if (lock->queue_order == ATBUILTIN_RWLOCK_QUEUE_ORDER_DEADLINE)
+  {
+    /* equal deadlines keep arrival order, and the head is never passed */
+    while (
+      node->prev && node->prev != lock->queue_head &&
+      node->prev->deadline > deadline
+    ) {
+      node->prev = node->prev->prev;
+    }
+  }
+  if (node->prev)
+  {
+    node->state = ATBUILTIN_RWLOCK_QUEUE_WAITING;
+    node->next = node->prev->next;
+    node->prev->next = node;
+  } else {
+    node->state = ATBUILTIN_RWLOCK_QUEUE_HEAD;
+    node->next = NULL;
+    lock->queue_head = node;
+    atbuiltin_queue_set_waiting(lock, true);
+  }
+  if (node->next)
+    node->next->prev = node;
+  else
+    lock->queue_tail = node;
+  atbuiltin_queue_unlock(lock);
+}
+
+/*
+  Sets the state of a node which may be sleeping. The owner of the node may
+  return as soon as it sees the state, so only the address is kept for the
+  futex wake.
+*/
+static inline void atbuiltin_queue_signal(atbuiltin_rwlock_queue_node_t *node, int state, int **wake, int *wake_cnt)
+{
+  if (atbuiltin_exchange_n(&node->state, state, ATBUILTIN_RWLOCK_RELEASE) ==
+    ATBUILTIN_RWLOCK_QUEUE_SLEEPING)
+  {
+    wake[(*wake_cnt)++] = &node->state;
+  }
+}
+
+/*
+  Called by the head with queue_lock. Removes the head, and with readers it
+  also removes up to QUEUE_GRANT_MAX readers which follow it and counts all of
+  them as readers in lock_body. The next node becomes the head.
+*/
+static inline int atbuiltin_queue_pop(atbuiltin_rwlock_t *lock, bool readers, int **wake)
+{
+  int cnt = 0, wake_cnt = 0;
+  atbuiltin_rwlock_queue_node_t *node, *next;
+  node = lock->queue_head->next;
+  if (readers)
+  {
+    for (next = node;
+      next && !next->writer && cnt < ATBUILTIN_RWLOCK_QUEUE_GRANT_MAX;
+      next = next->next)
+    {
+      cnt++;
+    }
+    atbuiltin_add_and_fetch(&lock->lock_body,
+      ATBUILTIN_RWLOCK_READER_ONE * (cnt + 1), ATBUILTIN_RWLOCK_ACQUIRE);
+    while (node != next)
+    {
+      /* node may be gone after it is granted */
+      atbuiltin_rwlock_queue_node_t *granted = node;
+      node = node->next;
+      atbuiltin_queue_signal(granted, ATBUILTIN_RWLOCK_QUEUE_GRANTED, wake,
+        &wake_cnt);
     }
-    pthread_mutex_unlock(&lock->mutex);
+  }
+  lock->queue_head = node;
+  if (node)
+  {
+    node->prev = NULL;
+    atbuiltin_queue_signal(node, ATBUILTIN_RWLOCK_QUEUE_HEAD, wake, &wake_cnt);
+  } else {
+    lock->queue_tail = NULL;
+    atbuiltin_queue_set_waiting(lock, false);
+  }
+  return wake_cnt;
+}
+
+static inline void atbuiltin_queue_wake(atbuiltin_rwlock_t *lock, int **wake, int wake_cnt)
+{
+  int i;
+  for (i = 0; i < wake_cnt; i++)
+  {
+    atbuiltin_futex_wake(wake[i], 1, atbuiltin_futex_flag(lock));
   }
 }
 
-static int atbuiltin_rwlock_rlock_read_priority(atbuiltin_rwlock_t *lock)
+/*
+  Waits until the node is granted or becomes the head. When it times out,
+  returns ETIMEDOUT without leaving the list.
+*/
+static inline int atbuiltin_queue_wait_node(atbuiltin_rwlock_t *lock, atbuiltin_rwlock_queue_node_t *node, const struct timespec *abstime)
 {
-  atbuiltin_rwlock_signed cnt;
-  if (lock->write_waiting)
+  int cnt, state;
+  for (cnt = 0; cnt < ATBUILTIN_RWLOCK_QUEUE_SPIN_MAX; cnt++)
   {
-    lock->read_waiting = true;
-    pthread_mutex_lock(&lock->mutex);
-    if (lock->write_waiting)
+    if (atbuiltin_load_n(&node->state, ATBUILTIN_RWLOCK_ACQUIRE) >=
+      ATBUILTIN_RWLOCK_QUEUE_GRANTED)
     {
-      pthread_cond_wait(&lock->cond, &lock->mutex);
+      return 0;
     }
-    pthread_mutex_unlock(&lock->mutex);
+    atbuiltin_cpu_relax();
   }
   while (true)
   {
-    cnt = atbuiltin_add_and_fetch(&lock->lock_body, 1, ATBUILTIN_RWLOCK_ACQUIRE);
-    if (cnt > 0)
+    state = atbuiltin_load_n(&node->state, ATBUILTIN_RWLOCK_ACQUIRE);
+    if (state >= ATBUILTIN_RWLOCK_QUEUE_GRANTED)
     {
-      lock->read_waiting = false;
-      /* lock success */
       return 0;
     }
-    lock->read_waiting = true;
-    atbuiltin_sub_and_fetch(&lock->lock_body, 1, ATBUILTIN_RWLOCK_RELAXED);
-    pthread_mutex_lock(&lock->mutex);
-    if (lock->write_waiting)
+    if (
+      state == ATBUILTIN_RWLOCK_QUEUE_WAITING &&
+      !atbuiltin_compare_and_swap_n(&node->state, &state,
+        ATBUILTIN_RWLOCK_QUEUE_SLEEPING, ATBUILTIN_RWLOCK_CAS_WEAK,
+        ATBUILTIN_RWLOCK_RELAXED, ATBUILTIN_RWLOCK_RELAXED)
+    ) {
+      continue;
+    }
+    if (atbuiltin_futex_wait(&node->state, ATBUILTIN_RWLOCK_QUEUE_SLEEPING,
+      abstime, atbuiltin_futex_flag(lock)) == ETIMEDOUT)
     {
-      pthread_cond_wait(&lock->cond, &lock->mutex);
+      return ETIMEDOUT;
     }
-    pthread_mutex_unlock(&lock->mutex);
   }
 }
 
-static int atbuiltin_rwlock_timedwlock_read_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout)
+/*
+  A reader at the head waits for the writer to leave, and a writer at the
+  head waits for all readers too. Nobody else takes the lock meanwhile,
+  because WRITE_WAITING is set.
+*/
+static inline bool atbuiltin_queue_head_busy(atbuiltin_rwlock_t *lock, bool writer, atbuiltin_rwlock_state state)
 {
-  int res;
-  struct timespec tss, tsc, tsr;
-  tsr = *timeout;
-  clock_gettime(CLOCK_MONOTONIC, &tss);
-  if ((res = atbuiltin_spin_timedlock(lock, &tsr)))
-  {
-    return res;
-  }
-  atbuiltin_add_and_fetch(&lock->writer_count, 1, ATBUILTIN_RWLOCK_RELAXED);
-  if (lock->write_waiting)
+  if (writer)
   {
-    /* lock success */
-    return 0;
+    return atbuiltin_rwlock_drain_busy(lock, state);
   }
-  register atbuiltin_rwlock_signed zero_val = 0;
-  if (atbuiltin_compare_and_swap_n(&lock->lock_body, &zero_val,
-    ATBUILTIN_RWLOCK_MIN_VAL, ATBUILTIN_RWLOCK_CAS_WEAK,
-    ATBUILTIN_RWLOCK_RELAXED, ATBUILTIN_RWLOCK_RELAXED))
+  return state & ATBUILTIN_RWLOCK_WRITE_LOCKED;
+}
+
+static inline int atbuiltin_queue_wait_head(atbuiltin_rwlock_t *lock, bool writer, const struct timespec *abstime)
+{
+  int cnt = 0, res;
+  atbuiltin_rwlock_state state;
+  while (true)
   {
-    lock->write_waiting = true;
-    /* lock success */
-    return 0;
+    state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_ACQUIRE);
+    if (!atbuiltin_queue_head_busy(lock, writer, state))
+    {
+      if (!writer)
+      {
+        return 0;
+      }
+      if (atbuiltin_compare_and_swap_n(&lock->lock_body, &state,
+        state | ATBUILTIN_RWLOCK_WRITE_LOCKED, ATBUILTIN_RWLOCK_CAS_WEAK,
+        ATBUILTIN_RWLOCK_ACQUIRE, ATBUILTIN_RWLOCK_RELAXED))
+      {
+        atbuiltin_write_seq_enter(lock);
+        return 0;
+      }
+      continue;
+    }
+    if (cnt < ATBUILTIN_RWLOCK_QUEUE_SPIN_MAX)
+    {
+      cnt++;
+      atbuiltin_cpu_relax();
+      continue;
+    }
+    res = 0;
+    atbuiltin_exchange_n(&lock->drain_waiting, 1, ATBUILTIN_RWLOCK_SEQ_CST);
+    if (atbuiltin_queue_head_busy(lock, writer,
+      atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_SEQ_CST)))
+    {
+      res = atbuiltin_futex_wait(&lock->drain_waiting, 1, abstime,
+        atbuiltin_futex_flag(lock));
+    }
+    atbuiltin_exchange_n(&lock->drain_waiting, 0, ATBUILTIN_RWLOCK_RELAXED);
+    if (res == ETIMEDOUT)
+    {
+      return ETIMEDOUT;
+    }
   }
-  while (true)
+}
+
+static inline int atbuiltin_queue_timedlock(atbuiltin_rwlock_t *lock, bool writer, const struct timespec *abstime)
+{
+  int res, wake_cnt;
+  int *wake[ATBUILTIN_RWLOCK_QUEUE_GRANT_MAX + 1];
+  atbuiltin_rwlock_queue_node_t node;
+  atbuiltin_queue_push(lock, &node, writer,
+    abstime ? get_nanosec_from_timespec(abstime) : ULLONG_MAX);
+  if ((res = atbuiltin_queue_wait_node(lock, &node, abstime)))
   {
-    zero_val = 0;
-    if (atbuiltin_compare_and_swap_n(&lock->lock_body, &zero_val,
-      ATBUILTIN_RWLOCK_MIN_VAL, ATBUILTIN_RWLOCK_CAS_WEAK,
-      ATBUILTIN_RWLOCK_RELAXED, ATBUILTIN_RWLOCK_RELAXED))
+    atbuiltin_queue_lock(lock);
+    /* the state does not change while holding queue_lock */
+    if (node.state == ATBUILTIN_RWLOCK_QUEUE_GRANTED)
     {
-      lock->write_waiting = true;
+      atbuiltin_queue_unlock(lock);
+      atbuiltin_rwlock_read_granted(lock);
       /* lock success */
       return 0;
     }
-    clock_gettime(CLOCK_MONOTONIC, &tsc);
-    if (timespec_sub(&tsr, &tss, &tsc))
+    if (node.state != ATBUILTIN_RWLOCK_QUEUE_HEAD)
     {
-      lock->write_waiting = false;
-      if (
-        atbuiltin_sub_and_fetch(&lock->writer_count, 1,
-          ATBUILTIN_RWLOCK_RELAXED) == 0 ||
-        lock->read_waiting ||
-        lock->tr_waiter_count
-      ) {
-        pthread_cond_broadcast(&lock->cond);
-      }
-      pthread_mutex_unlock(&lock->mutex);
-      return ETIMEDOUT;
+      node.prev->next = node.next;
+      if (node.next)
+        node.next->prev = node.prev;
+      else
+        lock->queue_tail = node.prev;
+      atbuiltin_queue_unlock(lock);
+      return res;
     }
-    if (lock->write_lock_interval)
+    atbuiltin_queue_unlock(lock);
+  } else if (node.state == ATBUILTIN_RWLOCK_QUEUE_GRANTED) {
+    atbuiltin_rwlock_read_granted(lock);
+    /* lock success */
+    return 0;
+  } else {
+    res = atbuiltin_queue_wait_head(lock, writer, abstime);
+  }
+  atbuiltin_queue_lock(lock);
+  wake_cnt = atbuiltin_queue_pop(lock, !res && !writer, wake);
+  atbuiltin_queue_unlock(lock);
+  atbuiltin_queue_wake(lock, wake, wake_cnt);
+  if (res)
+  {
+    return res;
+  }
+  if (!writer)
+  {
+    atbuiltin_rwlock_read_granted(lock);
+  }
+  /* lock success */
+  return 0;
+}
+
+static inline int atbuiltin_queue_write_trylock(atbuiltin_rwlock_t *lock)
+{
+  atbuiltin_rwlock_state state;
+  do {
+    state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED);
+    if (state & (ATBUILTIN_RWLOCK_READER_MASK |
+      ATBUILTIN_RWLOCK_WRITE_LOCKED | ATBUILTIN_RWLOCK_WRITE_WAITING))
     {
-      nanosleep(get_smaller_timespec(&tsr, &lock->write_lock_interval_ts), NULL);
+      return EBUSY;
     }
+  } while (!atbuiltin_compare_and_swap_n(&lock->lock_body, &state,
+    state | ATBUILTIN_RWLOCK_WRITE_LOCKED, ATBUILTIN_RWLOCK_CAS_WEAK,
+    ATBUILTIN_RWLOCK_SEQ_CST, ATBUILTIN_RWLOCK_RELAXED));
+  atbuiltin_write_seq_enter(lock);
+  if (
+    lock->read_counter_type == ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU &&
+    atbuiltin_read_slots_busy(lock)
+  ) {
+    atbuiltin_rwlock_wunlock_queue(lock);
+    return EBUSY;
   }
+  /* lock success */
+  return 0;
 }
 
-static int atbuiltin_rwlock_wlock_read_priority(atbuiltin_rwlock_t *lock)
+static int atbuiltin_rwlock_timedrlock_queue(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid)
 {
-  atbuiltin_add_and_fetch(&lock->writer_count, 1, ATBUILTIN_RWLOCK_RELAXED);
-  atbuiltin_spin_lock(lock);
-  if (lock->write_waiting)
+  struct timespec abstime;
+  if (!atbuiltin_rwlock_read_trylock(lock))
   {
     /* lock success */
     return 0;
   }
-  register atbuiltin_rwlock_signed zero_val = 0;
-  if (atbuiltin_compare_and_swap_n(&lock->lock_body, &zero_val,
-    ATBUILTIN_RWLOCK_MIN_VAL, ATBUILTIN_RWLOCK_CAS_WEAK,
-    ATBUILTIN_RWLOCK_RELAXED, ATBUILTIN_RWLOCK_RELAXED))
+  atbuiltin_deadline_init(&abstime, NULL, timeout, clockid);
+  return atbuiltin_queue_timedlock(lock, false, &abstime);
+}
+
+static int atbuiltin_rwlock_rlock_queue(atbuiltin_rwlock_t *lock)
+{
+  if (!atbuiltin_rwlock_read_trylock(lock))
   {
-    lock->write_waiting = true;
     /* lock success */
     return 0;
   }
-  while (true)
-  {
-    zero_val = 0;
-    if (atbuiltin_compare_and_swap_n(&lock->lock_body, &zero_val,
-      ATBUILTIN_RWLOCK_MIN_VAL, ATBUILTIN_RWLOCK_CAS_WEAK,
-      ATBUILTIN_RWLOCK_RELAXED, ATBUILTIN_RWLOCK_RELAXED))
-    {
-      lock->write_waiting = true;
-      /* lock success */
-      return 0;
-    }
-    if (lock->write_lock_interval)
-    {
-      nanosleep(&lock->write_lock_interval_ts, NULL);
-    }
-  }
+  return atbuiltin_queue_timedlock(lock, false, NULL);
 }
 
-static int atbuiltin_rwlock_wunlock_read_priority(atbuiltin_rwlock_t *lock)
+static int atbuiltin_rwlock_timedwlock_queue(atbuiltin_rwlock_t *lock, const struct timespec *timeout, clockid_t clockid)
 {
+  int res;
+  struct timespec abstime;
+  atbuiltin_deadline_init(&abstime, NULL, timeout, clockid);
   if (
-    atbuiltin_sub_and_fetch(&lock->writer_count, 1,
-      ATBUILTIN_RWLOCK_RELAXED) == 0 ||
-    lock->read_waiting ||
-    lock->tr_waiter_count
+    atbuiltin_queue_write_trylock(lock) &&
+    (res = atbuiltin_queue_timedlock(lock, true, &abstime))
   ) {
-    register atbuiltin_rwlock_signed min_val = ATBUILTIN_RWLOCK_MIN_VAL;
-    while (!atbuiltin_compare_and_swap_n(&lock->lock_body, &min_val, 0,
-      ATBUILTIN_RWLOCK_CAS_WEAK, ATBUILTIN_RWLOCK_RELAXED,
-      ATBUILTIN_RWLOCK_RELAXED))
-    {
-      min_val = ATBUILTIN_RWLOCK_MIN_VAL;
-    }
-    lock->write_waiting = false;
-    pthread_cond_broadcast(&lock->cond);
+    return res;
   }
-  pthread_mutex_unlock(&lock->mutex);
+  if ((res = atbuiltin_bias_revoke(lock, false, &abstime)))
+  {
+    atbuiltin_rwlock_wunlock_queue(lock);
+    return res;
+  }
+  /* lock success */
+  return 0;
+}
+
+static int atbuiltin_rwlock_wlock_queue(atbuiltin_rwlock_t *lock)
+{
+  if (atbuiltin_queue_write_trylock(lock))
+  {
+    atbuiltin_queue_timedlock(lock, true, NULL);
+  }
+  atbuiltin_bias_revoke(lock, false, NULL);
+  /* lock success */
+  return 0;
+}
+
+static int atbuiltin_rwlock_wunlock_queue(atbuiltin_rwlock_t *lock)
+{
+  atbuiltin_write_seq_exit(lock);
+  atbuiltin_sub_and_fetch(&lock->lock_body, ATBUILTIN_RWLOCK_WRITE_LOCKED,
+    ATBUILTIN_RWLOCK_SEQ_CST);
+  atbuiltin_wake_drain_writer(lock);
   /* unlock success */
   return 0;
 }
 
-static int atbuiltin_rwlock_timedrlock_no_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout)
+/*
+  Compact lock. All the state of a lock is lock_body of
+  atbuiltin_rwlock_compact_t, and threads which have to wait park in
+  atbuiltin_parking_lot, a hash table of wait queues which all compact locks
+  of the process share, keyed by the address of the lock. The parked bits of
+  lock_body are changed only while the bucket of the lock is locked, so a
+  thread which parks and a thread which unparks always agree on the queue.
+  A writer which releases the lock gives it to all parked readers, or else
+  to the first parked writer, and the last reader which leaves gives it to
+  the first parked writer, so woken threads already hold the lock. New
+  readers wait while a writer is parked, so readers do not starve writers.
+  The buckets are private to the process, so compact locks are not shared
+  between processes.
+*/
+#define ATBUILTIN_RWLOCK_PARKING_LOT_BITS 8
+#define ATBUILTIN_RWLOCK_PARK_WAITING 0
+#define ATBUILTIN_RWLOCK_PARK_GRANTED 1
+/* times a thread tries the lock word before it parks */
+#define ATBUILTIN_RWLOCK_COMPACT_SPIN_MAX 100
+struct atbuiltin_rwlock_park_node_t
+{
+  atbuiltin_rwlock_compact_t *lock;
+  bool writer;
+  bool parked;
+  int state;
+  atbuiltin_rwlock_park_node_t *prev;
+  atbuiltin_rwlock_park_node_t *next;
+};
+
+struct atbuiltin_rwlock_park_bucket_t
+{
+  int mutex;
+  atbuiltin_rwlock_park_node_t *head;
+  atbuiltin_rwlock_park_node_t *tail;
+} __attribute__((aligned(ATBUILTIN_RWLOCK_CACHE_LINE_SIZE)));
+
+static atbuiltin_rwlock_park_bucket_t
+  atbuiltin_parking_lot[1 << ATBUILTIN_RWLOCK_PARKING_LOT_BITS];
+
+static inline atbuiltin_rwlock_park_bucket_t *atbuiltin_park_bucket(atbuiltin_rwlock_compact_t *lock)
+{
+  unsigned long long int key = (unsigned long long int) (size_t) lock;
+  key = (key / sizeof(atbuiltin_rwlock_compact_t)) * 0x9E3779B97F4A7C15ULL;
+  return &atbuiltin_parking_lot[key >> (64 - ATBUILTIN_RWLOCK_PARKING_LOT_BITS)];
+}
+
+static inline void atbuiltin_park_bucket_lock(atbuiltin_rwlock_park_bucket_t *bucket)
+{
+  atbuiltin_futex_mutex_timedlock(&bucket->mutex, NULL, FUTEX_PRIVATE_FLAG);
+}
+
+static inline void atbuiltin_park_bucket_unlock(atbuiltin_rwlock_park_bucket_t *bucket)
+{
+  atbuiltin_futex_mutex_unlock(&bucket->mutex, FUTEX_PRIVATE_FLAG);
+}
+
+static inline void atbuiltin_park_push(atbuiltin_rwlock_park_bucket_t *bucket, atbuiltin_rwlock_park_node_t *node)
+{
+  node->parked = true;
+  node->next = NULL;
+  node->prev = bucket->tail;
+  if (bucket->tail)
+    bucket->tail->next = node;
+  else
+    bucket->head = node;
+  bucket->tail = node;
+}
+
+static inline void atbuiltin_park_remove(atbuiltin_rwlock_park_bucket_t *bucket, atbuiltin_rwlock_park_node_t *node)
 {
-  int res;
-  atbuiltin_rwlock_signed cnt;
-  struct timespec tss, tsc, tsr;
-  tsr = *timeout;
-  clock_gettime(CLOCK_MONOTONIC, &tss);
-  atbuiltin_add_and_fetch(&lock->tr_waiter_count, 1, ATBUILTIN_RWLOCK_RELAXED);
-  while (lock->write_waiting)
+  if (node->prev)
+    node->prev->next = node->next;
+  else
+    bucket->head = node->next;
+  if (node->next)
+    node->next->prev = node->prev;
+  else
+    bucket->tail = node->prev;
+  node->parked = false;
+}
+
+static inline atbuiltin_rwlock_park_node_t *atbuiltin_park_find(atbuiltin_rwlock_park_bucket_t *bucket, atbuiltin_rwlock_compact_t *lock, bool writer)
+{
+  atbuiltin_rwlock_park_node_t *node;
+  for (node = bucket->head; node; node = node->next)
   {
-    if ((res = pthread_mutex_timedlock(&lock->mutex, &tsr)))
-    {
-      atbuiltin_sub_and_fetch(&lock->tr_waiter_count, 1,
-        ATBUILTIN_RWLOCK_RELAXED);
-      return res;
-    }
-    if (lock->write_waiting)
-    {
-      clock_gettime(CLOCK_MONOTONIC, &tsc);
-      if (timespec_sub(&tsr, &tss, &tsc))
-      {
-        pthread_mutex_unlock(&lock->mutex);
-        atbuiltin_sub_and_fetch(&lock->tr_waiter_count, 1,
-          ATBUILTIN_RWLOCK_RELAXED);
-        return ETIMEDOUT;
-      }
-      if ((res = pthread_cond_timedwait(&lock->cond, &lock->mutex, &tsr)))
-      {
-        if (res == ETIMEDOUT)
-        {
-          pthread_mutex_unlock(&lock->mutex);
-          atbuiltin_sub_and_fetch(&lock->tr_waiter_count, 1,
-            ATBUILTIN_RWLOCK_RELAXED);
-          return ETIMEDOUT;
-        }
-      }
-    }
-    pthread_mutex_unlock(&lock->mutex);
-    clock_gettime(CLOCK_MONOTONIC, &tsc);
-    if (timespec_sub(&tsr, &tss, &tsc))
+    if (node->lock == lock && node->writer == writer)
     {
-      atbuiltin_sub_and_fetch(&lock->tr_waiter_count, 1,
-        ATBUILTIN_RWLOCK_RELAXED);
-      return ETIMEDOUT;
+      return node;
     }
   }
-  while (true)
+  return NULL;
+}
+
+/*
+  Unlinks all parked readers of the lock into the list of wake, and returns
+  how many they are.
+*/
+static inline unsigned long long int atbuiltin_park_take_readers(atbuiltin_rwlock_park_bucket_t *bucket, atbuiltin_rwlock_compact_t *lock, atbuiltin_rwlock_park_node_t **wake)
+{
+  unsigned long long int readers = 0;
+  atbuiltin_rwlock_park_node_t *node, *next;
+  for (node = bucket->head; node; node = next)
   {
-    cnt = atbuiltin_add_and_fetch(&lock->lock_body, 1, ATBUILTIN_RWLOCK_ACQUIRE);
-    if (cnt > 0)
-    {
-      atbuiltin_sub_and_fetch(&lock->tr_waiter_count, 1,
-        ATBUILTIN_RWLOCK_RELAXED);
-      /* lock success */
-      return 0;
-    }
-    atbuiltin_sub_and_fetch(&lock->lock_body, 1, ATBUILTIN_RWLOCK_RELAXED);
-    clock_gettime(CLOCK_MONOTONIC, &tsc);
-    if (timespec_sub(&tsr, &tss, &tsc))
-    {
-      atbuiltin_sub_and_fetch(&lock->tr_waiter_count, 1,
-        ATBUILTIN_RWLOCK_RELAXED);
-      return ETIMEDOUT;
-    }
-    if ((res = pthread_mutex_timedlock(&lock->mutex, &tsr)))
+    next = node->next;
+    if (node->lock == lock && !node->writer)
     {
-      atbuiltin_sub_and_fetch(&lock->tr_waiter_count, 1,
-        ATBUILTIN_RWLOCK_RELAXED);
-      return res;
-    }
-    if (lock->write_waiting)
-    {
-      clock_gettime(CLOCK_MONOTONIC, &tsc);
-      if (timespec_sub(&tsr, &tss, &tsc))
-      {
-        pthread_mutex_unlock(&lock->mutex);
-        atbuiltin_sub_and_fetch(&lock->tr_waiter_count, 1,
-          ATBUILTIN_RWLOCK_RELAXED);
-        return ETIMEDOUT;
-      }
-      if ((res = pthread_cond_timedwait(&lock->cond, &lock->mutex, &tsr)))
-      {
-        if (res == ETIMEDOUT)
-        {
-          pthread_mutex_unlock(&lock->mutex);
-          atbuiltin_sub_and_fetch(&lock->tr_waiter_count, 1,
-            ATBUILTIN_RWLOCK_RELAXED);
-          return ETIMEDOUT;
-        }
-      }
+      atbuiltin_park_remove(bucket, node);
+      node->next = *wake;
+      *wake = node;
+      readers++;
     }
-    pthread_mutex_unlock(&lock->mutex);
   }
+  return readers;
 }
 
-static int atbuiltin_rwlock_rlock_no_priority(atbuiltin_rwlock_t *lock)
+static inline atbuiltin_rwlock_park_node_t *atbuiltin_park_take_writer(atbuiltin_rwlock_park_bucket_t *bucket, atbuiltin_rwlock_compact_t *lock)
 {
-  atbuiltin_rwlock_signed cnt;
-  while (lock->write_waiting)
+  atbuiltin_rwlock_park_node_t *node = atbuiltin_park_find(bucket, lock, true);
+  if (node)
   {
-    lock->read_waiting = true;
-    pthread_mutex_lock(&lock->mutex);
-    if (lock->write_waiting)
-    {
-      pthread_cond_wait(&lock->cond, &lock->mutex);
-    }
-    pthread_mutex_unlock(&lock->mutex);
+    atbuiltin_park_remove(bucket, node);
+    node->next = NULL;
   }
-  while (true)
+  return node;
+}
+
+/*
+  Called after the bucket is unlocked. A node is on the stack of its thread,
+  which may return as soon as it sees GRANTED, so next is read before that.
+*/
+static inline void atbuiltin_park_wake(atbuiltin_rwlock_park_node_t *wake)
+{
+  atbuiltin_rwlock_park_node_t *next;
+  while (wake)
   {
-    cnt = atbuiltin_add_and_fetch(&lock->lock_body, 1, ATBUILTIN_RWLOCK_ACQUIRE);
-    if (cnt > 0)
-    {
-      lock->read_waiting = false;
-      /* lock success */
-      return 0;
-    }
-    lock->read_waiting = true;
-    atbuiltin_sub_and_fetch(&lock->lock_body, 1, ATBUILTIN_RWLOCK_RELAXED);
-    pthread_mutex_lock(&lock->mutex);
-    if (lock->write_waiting)
-    {
-      pthread_cond_wait(&lock->cond, &lock->mutex);
-    }
-    pthread_mutex_unlock(&lock->mutex);
+    next = wake->next;
+    atbuiltin_store_n(&wake->state, ATBUILTIN_RWLOCK_PARK_GRANTED,
+      ATBUILTIN_RWLOCK_RELEASE);
+    atbuiltin_futex_wake(&wake->state, 1, FUTEX_PRIVATE_FLAG);
+    wake = next;
   }
 }
 
-static int atbuiltin_rwlock_timedwlock_no_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout)
+/*
+  Called with the bucket locked by a writer which releases the lock while
+  threads are parked, or by the last reader which leaves while a writer is
+  parked. Returns the nodes which are given the lock.
+*/
+static inline atbuiltin_rwlock_park_node_t *atbuiltin_compact_handoff(atbuiltin_rwlock_compact_t *lock, atbuiltin_rwlock_park_bucket_t *bucket, bool from_writer)
 {
-  int res;
-  struct timespec tss, tsc, tsr;
-  tsr = *timeout;
-  clock_gettime(CLOCK_MONOTONIC, &tss);
-  if ((res = atbuiltin_spin_timedlock(lock, &tsr)))
+  unsigned long long int readers = 0;
+  bool write_parked = false;
+  atbuiltin_rwlock_state state, new_state;
+  atbuiltin_rwlock_park_node_t *wake = NULL;
+  state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_SEQ_CST);
+  if (from_writer && (state & ATBUILTIN_RWLOCK_COMPACT_READ_PARKED))
   {
-    return res;
+    readers = atbuiltin_park_take_readers(bucket, lock, &wake);
+  } else if (
+    (state & ATBUILTIN_RWLOCK_COMPACT_WRITE_PARKED) &&
+    !(state & ATBUILTIN_RWLOCK_COMPACT_READER_MASK) &&
+    (from_writer || !(state & ATBUILTIN_RWLOCK_COMPACT_WRITE_LOCKED))
+  ) {
+    wake = atbuiltin_park_take_writer(bucket, lock);
+    write_parked = atbuiltin_park_find(bucket, lock, true) != NULL;
   }
-  atbuiltin_add_and_fetch(&lock->writer_count, 1, ATBUILTIN_RWLOCK_RELAXED);
-  if (lock->write_waiting)
+  if (!from_writer && !wake)
   {
-    /* lock success */
-    return 0;
+    return NULL;
   }
-  lock->write_waiting = true;
-  register atbuiltin_rwlock_signed zero_val = 0;
-  if (atbuiltin_compare_and_swap_n(&lock->lock_body, &zero_val,
-    ATBUILTIN_RWLOCK_MIN_VAL, ATBUILTIN_RWLOCK_CAS_WEAK,
-    ATBUILTIN_RWLOCK_RELAXED, ATBUILTIN_RWLOCK_RELAXED))
+  do {
+    state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED);
+    if (readers)
+    {
+      new_state = (state & ~(ATBUILTIN_RWLOCK_COMPACT_WRITE_LOCKED |
+        ATBUILTIN_RWLOCK_COMPACT_READ_PARKED)) + readers;
+    } else if (wake) {
+      new_state = (state & ~ATBUILTIN_RWLOCK_COMPACT_WRITE_PARKED) |
+        ATBUILTIN_RWLOCK_COMPACT_WRITE_LOCKED |
+        (write_parked ? ATBUILTIN_RWLOCK_COMPACT_WRITE_PARKED : 0);
+    } else {
+      new_state = state & ~ATBUILTIN_RWLOCK_COMPACT_WRITE_LOCKED;
+    }
+  } while (!atbuiltin_compare_and_swap_n(&lock->lock_body, &state, new_state,
+    ATBUILTIN_RWLOCK_CAS_WEAK, ATBUILTIN_RWLOCK_SEQ_CST,
+    ATBUILTIN_RWLOCK_RELAXED));
+  return wake;
+}
+
+/*
+  Called with the bucket locked by a thread which timed out and removed its
+  own node. When the last parked writer leaves while no writer holds the
+  lock, the readers parked behind it are given the lock.
+*/
+static inline atbuiltin_rwlock_park_node_t *atbuiltin_compact_unpark(atbuiltin_rwlock_compact_t *lock, atbuiltin_rwlock_park_bucket_t *bucket, bool writer)
+{
+  unsigned long long int readers = 0;
+  atbuiltin_rwlock_state state, new_state;
+  atbuiltin_rwlock_park_node_t *wake = NULL;
+  if (atbuiltin_park_find(bucket, lock, writer))
   {
-    /* lock success */
-    return 0;
+    return NULL;
   }
-  while (true)
-  {
-    zero_val = 0;
-    if (atbuiltin_compare_and_swap_n(&lock->lock_body, &zero_val,
-      ATBUILTIN_RWLOCK_MIN_VAL, ATBUILTIN_RWLOCK_CAS_WEAK,
-      ATBUILTIN_RWLOCK_RELAXED, ATBUILTIN_RWLOCK_RELAXED))
+  state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_SEQ_CST);
+  if (
+    writer &&
+    (state & ATBUILTIN_RWLOCK_COMPACT_READ_PARKED) &&
+    !(state & ATBUILTIN_RWLOCK_COMPACT_WRITE_LOCKED)
+  ) {
+    readers = atbuiltin_park_take_readers(bucket, lock, &wake);
+  }
+  do {
+    state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED);
+    new_state = state & ~(writer ? ATBUILTIN_RWLOCK_COMPACT_WRITE_PARKED :
+      ATBUILTIN_RWLOCK_COMPACT_READ_PARKED);
+    if (readers)
     {
-      /* lock success */
-      return 0;
+      new_state = (new_state & ~ATBUILTIN_RWLOCK_COMPACT_READ_PARKED) +
+        readers;
     }
-    clock_gettime(CLOCK_MONOTONIC, &tsc);
-    if (timespec_sub(&tsr, &tss, &tsc))
+  } while (!atbuiltin_compare_and_swap_n(&lock->lock_body, &state, new_state,
+    ATBUILTIN_RWLOCK_CAS_WEAK, ATBUILTIN_RWLOCK_SEQ_CST,
+    ATBUILTIN_RWLOCK_RELAXED));
+  return wake;
+}
+
+/*
+  Parks the thread until it is given the lock. Returns EAGAIN without
+  parking when the lock became free before the parked bit was set.
+*/
+static inline int atbuiltin_compact_park(atbuiltin_rwlock_compact_t *lock, bool writer, const struct timespec *abstime)
+{
+  int res = 0;
+  atbuiltin_rwlock_state state, busy;
+  atbuiltin_rwlock_park_node_t node, *wake = NULL;
+  atbuiltin_rwlock_park_bucket_t *bucket = atbuiltin_park_bucket(lock);
+  busy = writer ?
+    ATBUILTIN_RWLOCK_COMPACT_READER_MASK |
+    ATBUILTIN_RWLOCK_COMPACT_WRITE_LOCKED |
+    ATBUILTIN_RWLOCK_COMPACT_WRITE_PARKED :
+    ATBUILTIN_RWLOCK_COMPACT_WRITE_LOCKED |
+    ATBUILTIN_RWLOCK_COMPACT_WRITE_PARKED;
+  atbuiltin_park_bucket_lock(bucket);
+  do {
+    state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED);
+    if (!(state & busy))
     {
-      lock->write_waiting = false;
-      if (
-        atbuiltin_sub_and_fetch(&lock->writer_count, 1,
-          ATBUILTIN_RWLOCK_RELAXED) == 0 ||
-        lock->read_waiting ||
-        lock->tr_waiter_count
-      ) {
-        pthread_cond_broadcast(&lock->cond);
-      }
-      pthread_mutex_unlock(&lock->mutex);
-      return ETIMEDOUT;
+      atbuiltin_park_bucket_unlock(bucket);
+      return EAGAIN;
     }
-    if (lock->write_lock_interval)
+  } while (!atbuiltin_compare_and_swap_n(&lock->lock_body, &state,
+    state | (writer ? ATBUILTIN_RWLOCK_COMPACT_WRITE_PARKED :
+      ATBUILTIN_RWLOCK_COMPACT_READ_PARKED), ATBUILTIN_RWLOCK_CAS_WEAK,
+    ATBUILTIN_RWLOCK_SEQ_CST, ATBUILTIN_RWLOCK_RELAXED));
+  node.lock = lock;
+  node.writer = writer;
+  node.state = ATBUILTIN_RWLOCK_PARK_WAITING;
+  atbuiltin_park_push(bucket, &node);
+  atbuiltin_park_bucket_unlock(bucket);
+  while (atbuiltin_load_n(&node.state, ATBUILTIN_RWLOCK_ACQUIRE) ==
+    ATBUILTIN_RWLOCK_PARK_WAITING)
+  {
+    if (atbuiltin_futex_wait(&node.state, ATBUILTIN_RWLOCK_PARK_WAITING,
+      abstime, FUTEX_PRIVATE_FLAG) == ETIMEDOUT)
     {
-      nanosleep(get_smaller_timespec(&tsr, &lock->write_lock_interval_ts), NULL);
+      res = ETIMEDOUT;
+      break;
     }
   }
-}
-
-static int atbuiltin_rwlock_wlock_no_priority(atbuiltin_rwlock_t *lock)
-{
-  atbuiltin_add_and_fetch(&lock->writer_count, 1, ATBUILTIN_RWLOCK_RELAXED);
-  atbuiltin_spin_lock(lock);
-  if (lock->write_waiting)
+  if (!res)
   {
     /* lock success */
     return 0;
   }
-  lock->write_waiting = true;
-  register atbuiltin_rwlock_signed zero_val = 0;
-  if (atbuiltin_compare_and_swap_n(&lock->lock_body, &zero_val,
-    ATBUILTIN_RWLOCK_MIN_VAL, ATBUILTIN_RWLOCK_CAS_WEAK,
-    ATBUILTIN_RWLOCK_RELAXED, ATBUILTIN_RWLOCK_RELAXED))
+  atbuiltin_park_bucket_lock(bucket);
+  if (node.parked)
   {
-    /* lock success */
-    return 0;
+    atbuiltin_park_remove(bucket, &node);
+    wake = atbuiltin_compact_unpark(lock, bucket, writer);
+  } else {
+    /* the lock was given to this thread at the same time */
+    res = 0;
   }
-  while (true)
+  atbuiltin_park_bucket_unlock(bucket);
+  if (res)
   {
-    zero_val = 0;
-    if (atbuiltin_compare_and_swap_n(&lock->lock_body, &zero_val,
-      ATBUILTIN_RWLOCK_MIN_VAL, ATBUILTIN_RWLOCK_CAS_WEAK,
-      ATBUILTIN_RWLOCK_RELAXED, ATBUILTIN_RWLOCK_RELAXED))
-    {
-      /* lock success */
-      return 0;
-    }
-    if (lock->write_lock_interval)
-    {
-      nanosleep(&lock->write_lock_interval_ts, NULL);
-    }
+    atbuiltin_park_wake(wake);
+    return res;
   }
+  while (atbuiltin_load_n(&node.state, ATBUILTIN_RWLOCK_ACQUIRE) ==
+    ATBUILTIN_RWLOCK_PARK_WAITING)
+  {
+    atbuiltin_futex_wait(&node.state, ATBUILTIN_RWLOCK_PARK_WAITING, NULL,
+      FUTEX_PRIVATE_FLAG);
+  }
+  /* lock success */
+  return 0;
 }
 
-static int atbuiltin_rwlock_wunlock_no_priority(atbuiltin_rwlock_t *lock)
+static inline int atbuiltin_compact_trylock(atbuiltin_rwlock_compact_t *lock, bool writer)
 {
-  if (
-    atbuiltin_sub_and_fetch(&lock->writer_count, 1,
-      ATBUILTIN_RWLOCK_RELAXED) == 0 ||
-    lock->read_waiting ||
-    lock->tr_waiter_count
-  ) {
-    register atbuiltin_rwlock_signed min_val = ATBUILTIN_RWLOCK_MIN_VAL;
-    while (!atbuiltin_compare_and_swap_n(&lock->lock_body, &min_val, 0,
-      ATBUILTIN_RWLOCK_CAS_WEAK, ATBUILTIN_RWLOCK_RELAXED,
-      ATBUILTIN_RWLOCK_RELAXED))
+  atbuiltin_rwlock_state state;
+  do {
+    state = atbuiltin_load_n(&lock->lock_body, ATBUILTIN_RWLOCK_RELAXED);
+    if (writer ? state != 0 : (state & (ATBUILTIN_RWLOCK_COMPACT_WRITE_LOCKED |
+      ATBUILTIN_RWLOCK_COMPACT_WRITE_PARKED)) != 0)
     {
-      min_val = ATBUILTIN_RWLOCK_MIN_VAL;
+      return EBUSY;
     }
-    lock->write_waiting = false;
-    pthread_cond_broadcast(&lock->cond);
-  }
-  pthread_mutex_unlock(&lock->mutex);
-  /* unlock success */
+  } while (!atbuiltin_compare_and_swap_n(&lock->lock_body, &state,
+    writer ? ATBUILTIN_RWLOCK_COMPACT_WRITE_LOCKED :
+    state + ATBUILTIN_RWLOCK_COMPACT_READER_ONE, ATBUILTIN_RWLOCK_CAS_WEAK,
+    ATBUILTIN_RWLOCK_ACQUIRE, ATBUILTIN_RWLOCK_RELAXED));
+  /* lock success */
   return 0;
 }
 
-static int atbuiltin_rwlock_timedrlock_write_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout)
+static inline int atbuiltin_compact_timedlock(atbuiltin_rwlock_compact_t *lock, bool writer, const struct timespec *abstime)
 {
-  int res;
-  atbuiltin_rwlock_signed cnt;
-  struct timespec tss, tsc, tsr;
-  tsr = *timeout;
-  clock_gettime(CLOCK_MONOTONIC, &tss);
-  while (lock->write_waiting)
+  int cnt, res;
+  while (true)
   {
-    if ((res = pthread_mutex_timedlock(&lock->mutex, &tsr)))
-    {
-      return res;
-    }
-    if (lock->write_waiting)
+    for (cnt = 0; cnt < ATBUILTIN_RWLOCK_COMPACT_SPIN_MAX; cnt++)
     {
-      clock_gettime(CLOCK_MONOTONIC, &tsc);
-      if (timespec_sub(&tsr, &tss, &tsc))
-      {
-        pthread_mutex_unlock(&lock->mutex);
-        return ETIMEDOUT;
-      }
-      if ((res = pthread_cond_timedwait(&lock->cond, &lock->mutex, &tsr)))
+      if (!atbuiltin_compact_trylock(lock, writer))
       {
-        if (res == ETIMEDOUT)
-        {
-          pthread_mutex_unlock(&lock->mutex);
-          return ETIMEDOUT;
-        }
+        /* lock success */
+        return 0;
       }
+      atbuiltin_cpu_relax();
     }
-    pthread_mutex_unlock(&lock->mutex);
-    clock_gettime(CLOCK_MONOTONIC, &tsc);
-    if (timespec_sub(&tsr, &tss, &tsc))
+    if ((res = atbuiltin_compact_park(lock, writer, abstime)) != EAGAIN)
     {
-      return ETIMEDOUT;
+      return res;
     }
   }
-  while (true)
+}
+
+int atbuiltin_rwlock_compact_init(atbuiltin_rwlock_compact_t *lock)
+{
+  lock->lock_body = 0;
+  return 0;
+}
+
+int atbuiltin_rwlock_compact_destroy(atbuiltin_rwlock_compact_t *lock)
+{
+  (void) lock;
+  return 0;
+}
+
+int atbuiltin_rwlock_compact_tryrlock(atbuiltin_rwlock_compact_t *lock)
+{
+  return atbuiltin_compact_trylock(lock, false);
+}
+
+int atbuiltin_rwlock_compact_timedrlock(atbuiltin_rwlock_compact_t *lock, const struct timespec *timeout)
+{
+  struct timespec abstime;
+  if (!atbuiltin_compact_trylock(lock, false))
   {
-    cnt = atbuiltin_add_and_fetch(&lock->lock_body, 1, ATBUILTIN_RWLOCK_ACQUIRE);
-    if (cnt > 0)
-    {
-      /* lock success */
-      return 0;
-    }
-    atbuiltin_sub_and_fetch(&lock->lock_body, 1, ATBUILTIN_RWLOCK_RELAXED);
-    clock_gettime(CLOCK_MONOTONIC, &tsc);
-    if (timespec_sub(&tsr, &tss, &tsc))
-    {
-      return ETIMEDOUT;
-    }
-    if ((res = pthread_mutex_timedlock(&lock->mutex, &tsr)))
-    {
-      return res;
-    }
-    if (lock->write_waiting)
-    {
-      clock_gettime(CLOCK_MONOTONIC, &tsc);
-      if (timespec_sub(&tsr, &tss, &tsc))
-      {
-        pthread_mutex_unlock(&lock->mutex);
-        return ETIMEDOUT;
-      }
-      if ((res = pthread_cond_timedwait(&lock->cond, &lock->mutex, &tsr)))
-      {
-        if (res == ETIMEDOUT)
-        {
-          pthread_mutex_unlock(&lock->mutex);
-          return ETIMEDOUT;
-        }
-      }
-    }
-    pthread_mutex_unlock(&lock->mutex);
+    /* lock success */
+    return 0;
   }
+  atbuiltin_deadline_init(&abstime, NULL, timeout,
+    ATBUILTIN_RWLOCK_TIMEOUT_RELATIVE);
+  return atbuiltin_compact_timedlock(lock, false, &abstime);
 }
 
-static int atbuiltin_rwlock_rlock_write_priority(atbuiltin_rwlock_t *lock)
+int atbuiltin_rwlock_compact_clockrlock(atbuiltin_rwlock_compact_t *lock, clockid_t clockid, const struct timespec *abstime)
 {
-  atbuiltin_rwlock_signed cnt;
-  while (lock->write_waiting)
+  struct timespec ts;
+  if (atbuiltin_clock_invalid(clockid, abstime))
   {
-    pthread_mutex_lock(&lock->mutex);
-    if (lock->write_waiting)
-    {
-      pthread_cond_wait(&lock->cond, &lock->mutex);
-    }
-    pthread_mutex_unlock(&lock->mutex);
+    return EINVAL;
   }
-  while (true)
+  if (!atbuiltin_compact_trylock(lock, false))
   {
-    cnt = atbuiltin_add_and_fetch(&lock->lock_body, 1, ATBUILTIN_RWLOCK_ACQUIRE);
-    if (cnt > 0)
-    {
-      /* lock success */
-      return 0;
-    }
-    atbuiltin_sub_and_fetch(&lock->lock_body, 1, ATBUILTIN_RWLOCK_RELAXED);
-    pthread_mutex_lock(&lock->mutex);
-    if (lock->write_waiting)
-    {
-      pthread_cond_wait(&lock->cond, &lock->mutex);
-    }
-    pthread_mutex_unlock(&lock->mutex);
+    /* lock success */
+    return 0;
   }
+  atbuiltin_deadline_init(&ts, NULL, abstime, clockid);
+  return atbuiltin_compact_timedlock(lock, false, &ts);
 }
 
-static int atbuiltin_rwlock_timedwlock_write_priority(atbuiltin_rwlock_t *lock, const struct timespec *timeout)
+int atbuiltin_rwlock_compact_rlock(atbuiltin_rwlock_compact_t *lock)
 {
-  int res;
-  struct timespec tss, tsc, tsr;
-  tsr = *timeout;
-  clock_gettime(CLOCK_MONOTONIC, &tss);
-  if ((res = atbuiltin_spin_timedlock(lock, &tsr)))
+  return atbuiltin_compact_timedlock(lock, false, NULL);
+}
+
+int atbuiltin_rwlock_compact_runlock(atbuiltin_rwlock_compact_t *lock)
+{
+  atbuiltin_rwlock_state state;
+  atbuiltin_rwlock_park_node_t *wake;
+  atbuiltin_rwlock_park_bucket_t *bucket;
+  state = atbuiltin_sub_and_fetch(&lock->lock_body,
+    ATBUILTIN_RWLOCK_COMPACT_READER_ONE, ATBUILTIN_RWLOCK_RELEASE);
+  if ((state & (ATBUILTIN_RWLOCK_COMPACT_READER_MASK |
+    ATBUILTIN_RWLOCK_COMPACT_WRITE_PARKED)) ==
+    ATBUILTIN_RWLOCK_COMPACT_WRITE_PARKED)
   {
-    return res;
+    bucket = atbuiltin_park_bucket(lock);
+    atbuiltin_park_bucket_lock(bucket);
+    wake = atbuiltin_compact_handoff(lock, bucket, false);
+    atbuiltin_park_bucket_unlock(bucket);
+    atbuiltin_park_wake(wake);
   }
-  atbuiltin_add_and_fetch(&lock->writer_count, 1, ATBUILTIN_RWLOCK_RELAXED);
-  if (lock->write_waiting)
+  /* unlock success */
+  return 0;
+}
+
+int atbuiltin_rwlock_compact_trywlock(atbuiltin_rwlock_compact_t *lock)
+{
+  return atbuiltin_compact_trylock(lock, true);
+}
+
+int atbuiltin_rwlock_compact_timedwlock(atbuiltin_rwlock_compact_t *lock, const struct timespec *timeout)
+{
+  struct timespec abstime;
+  if (!atbuiltin_compact_trylock(lock, true))
   {
     /* lock success */
     return 0;
   }
-  lock->write_waiting = true;
-  register atbuiltin_rwlock_signed zero_val = 0;
-  if (atbuiltin_compare_and_swap_n(&lock->lock_body, &zero_val,
-    ATBUILTIN_RWLOCK_MIN_VAL, ATBUILTIN_RWLOCK_CAS_WEAK,
-    ATBUILTIN_RWLOCK_RELAXED, ATBUILTIN_RWLOCK_RELAXED))
+  atbuiltin_deadline_init(&abstime, NULL, timeout,
+    ATBUILTIN_RWLOCK_TIMEOUT_RELATIVE);
+  return atbuiltin_compact_timedlock(lock, true, &abstime);
+}
+
+int atbuiltin_rwlock_compact_clockwlock(atbuiltin_rwlock_compact_t *lock, clockid_t clockid, const struct timespec *abstime)
+{
+  struct timespec ts;
+  if (atbuiltin_clock_invalid(clockid, abstime))
+  {
+    return EINVAL;
+  }
+  if (!atbuiltin_compact_trylock(lock, true))
   {
     /* lock success */
     return 0;
   }
-  while (true)
+  atbuiltin_deadline_init(&ts, NULL, abstime, clockid);
+  return atbuiltin_compact_timedlock(lock, true, &ts);
+}
+
+int atbuiltin_rwlock_compact_wlock(atbuiltin_rwlock_compact_t *lock)
+{
+  return atbuiltin_compact_timedlock(lock, true, NULL);
+}
+
+int atbuiltin_rwlock_compact_wunlock(atbuiltin_rwlock_compact_t *lock)
+{
+  atbuiltin_rwlock_state state = ATBUILTIN_RWLOCK_COMPACT_WRITE_LOCKED;
+  atbuiltin_rwlock_park_node_t *wake;
+  atbuiltin_rwlock_park_bucket_t *bucket;
+  if (!atbuiltin_compare_and_swap_n(&lock->lock_body, &state, 0, false,
+    ATBUILTIN_RWLOCK_RELEASE, ATBUILTIN_RWLOCK_RELAXED))
   {
-    zero_val = 0;
-    if (atbuiltin_compare_and_swap_n(&lock->lock_body, &zero_val,
-      ATBUILTIN_RWLOCK_MIN_VAL, ATBUILTIN_RWLOCK_CAS_WEAK,
-      ATBUILTIN_RWLOCK_RELAXED, ATBUILTIN_RWLOCK_RELAXED))
-    {
-      /* lock success */
-      return 0;
-    }
-    clock_gettime(CLOCK_MONOTONIC, &tsc);
-    if (timespec_sub(&tsr, &tss, &tsc))
-    {
-      lock->write_waiting = false;
-      if (atbuiltin_sub_and_fetch(&lock->writer_count, 1,
-        ATBUILTIN_RWLOCK_RELAXED) == 0)
-      {
-        pthread_cond_broadcast(&lock->cond);
-      }
-      pthread_mutex_unlock(&lock->mutex);
-      return ETIMEDOUT;
-    }
-    if (lock->write_lock_interval)
+    bucket = atbuiltin_park_bucket(lock);
+    atbuiltin_park_bucket_lock(bucket);
+    wake = atbuiltin_compact_handoff(lock, bucket, true);
+    atbuiltin_park_bucket_unlock(bucket);
+    atbuiltin_park_wake(wake);
+  }
+  /* unlock success */
+  return 0;
+}
+
+/*
+  Lock arrays. Each lock starts at a cache line and takes whole cache lines,
+  so neighbouring locks do not share a line. The memory is mapped
+  anonymously, so it is zeroed, and without attr every lock is already same
+  as ATBUILTIN_RWLOCK_INITIALIZER. Such pages are placed on the NUMA node of
+  the thread which uses them first. With attr or with
+  ATBUILTIN_RWLOCK_ARRAY_LOCAL_NODE, the calling thread initializes all locks,
+  so all pages are placed on its node. With ATBUILTIN_RWLOCK_ARRAY_HUGEPAGE,
+  reserved huge pages are tried first, and transparent huge pages are asked
+  for when none are reserved.
+*/
+#define ATBUILTIN_RWLOCK_HUGEPAGE_SIZE (2UL * 1024 * 1024)
+
+static inline size_t atbuiltin_round_up(size_t size, size_t unit)
+{
+  return (size + unit - 1) / unit * unit;
+}
+
+static void *atbuiltin_array_map(size_t *size, int flags)
+{
+  void *memory;
+  long page_size;
+#ifdef MAP_HUGETLB
+  if (flags & ATBUILTIN_RWLOCK_ARRAY_HUGEPAGE)
+  {
+    memory = mmap(NULL,
+      atbuiltin_round_up(*size, ATBUILTIN_RWLOCK_HUGEPAGE_SIZE),
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1,
+      0);
+    if (memory != MAP_FAILED)
     {
-      nanosleep(get_smaller_timespec(&tsr, &lock->write_lock_interval_ts), NULL);
+      *size = atbuiltin_round_up(*size, ATBUILTIN_RWLOCK_HUGEPAGE_SIZE);
+      return memory;
     }
   }
+#endif
+  if ((page_size = sysconf(_SC_PAGESIZE)) < 1)
+    page_size = 4096;
+  *size = atbuiltin_round_up(*size, (size_t) page_size);
+  memory = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+  {
+    return NULL;
+  }
+#ifdef MADV_HUGEPAGE
+  if (flags & ATBUILTIN_RWLOCK_ARRAY_HUGEPAGE)
+  {
+    madvise(memory, *size, MADV_HUGEPAGE);
+  }
+#endif
+  return memory;
 }
 
-static int atbuiltin_rwlock_wlock_write_priority(atbuiltin_rwlock_t *lock)
+int atbuiltin_rwlock_array_init(atbuiltin_rwlock_array_t *array, size_t count, const atbuiltin_rwlock_attr_t *attr, int flags)
 {
-  atbuiltin_add_and_fetch(&lock->writer_count, 1, ATBUILTIN_RWLOCK_RELAXED);
-  atbuiltin_spin_lock(lock);
-  if (lock->write_waiting)
+  int ret;
+  size_t i, size;
+  array->stride = atbuiltin_round_up(sizeof(atbuiltin_rwlock_t),
+    ATBUILTIN_RWLOCK_CACHE_LINE_SIZE);
+  if (!count || count > ((size_t) -1) / 2 / array->stride)
   {
-    /* lock success */
-    return 0;
+    return EINVAL;
   }
-  lock->write_waiting = true;
-  register atbuiltin_rwlock_signed zero_val = 0;
-  if (atbuiltin_compare_and_swap_n(&lock->lock_body, &zero_val,
-    ATBUILTIN_RWLOCK_MIN_VAL, ATBUILTIN_RWLOCK_CAS_WEAK,
-    ATBUILTIN_RWLOCK_RELAXED, ATBUILTIN_RWLOCK_RELAXED))
+  size = count * array->stride;
+  if (!(array->memory = atbuiltin_array_map(&size, flags)))
+  {
+    return ENOMEM;
+  }
+  array->size = size;
+  array->count = count;
+  if (!attr && !(flags & ATBUILTIN_RWLOCK_ARRAY_LOCAL_NODE))
   {
-    /* lock success */
     return 0;
   }
-  while (true)
+  for (i = 0; i < count; i++)
   {
-    zero_val = 0;
-    if (atbuiltin_compare_and_swap_n(&lock->lock_body, &zero_val,
-      ATBUILTIN_RWLOCK_MIN_VAL, ATBUILTIN_RWLOCK_CAS_WEAK,
-      ATBUILTIN_RWLOCK_RELAXED, ATBUILTIN_RWLOCK_RELAXED))
-    {
-      /* lock success */
-      return 0;
-    }
-    if (lock->write_lock_interval)
+    if ((ret = atbuiltin_rwlock_init(atbuiltin_rwlock_array_get(array, i),
+      attr)))
     {
-      nanosleep(&lock->write_lock_interval_ts, NULL);
+      while (i--)
+      {
+        atbuiltin_rwlock_destroy(atbuiltin_rwlock_array_get(array, i));
+      }
+      munmap(array->memory, array->size);
+      array->memory = NULL;
+      return ret;
     }
   }
+  return 0;
 }
 
-static int atbuiltin_rwlock_wunlock_write_priority(atbuiltin_rwlock_t *lock)
+int atbuiltin_rwlock_array_destroy(atbuiltin_rwlock_array_t *array)
 {
-  if (atbuiltin_sub_and_fetch(&lock->writer_count, 1,
-    ATBUILTIN_RWLOCK_RELAXED) == 0)
+  int ret = 0, res;
+  size_t i;
+  for (i = 0; i < array->count; i++)
   {
-    register atbuiltin_rwlock_signed min_val = ATBUILTIN_RWLOCK_MIN_VAL;
-    while (!atbuiltin_compare_and_swap_n(&lock->lock_body, &min_val, 0,
-      ATBUILTIN_RWLOCK_CAS_WEAK, ATBUILTIN_RWLOCK_RELAXED,
-      ATBUILTIN_RWLOCK_RELAXED))
+    if ((res = atbuiltin_rwlock_destroy(atbuiltin_rwlock_array_get(array, i))))
     {
-      min_val = ATBUILTIN_RWLOCK_MIN_VAL;
+      if (!ret)
+        ret = res;
     }
-    lock->write_waiting = false;
-    pthread_cond_broadcast(&lock->cond);
   }
-  pthread_mutex_unlock(&lock->mutex);
-  /* unlock success */
-  return 0;
+  if (munmap(array->memory, array->size) && !ret)
+  {
+    ret = errno;
+  }
+  array->memory = NULL;
+  return ret;
 }
@@ -0,0 +1,243 @@
+/*
+  Tests of atbuiltin RW lock functions
+
+  Copyright (C) 2014, Kentoku SHIBA
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of Kentoku SHIBA nor the names of its contributors
+        may be used to endorse or promote products derived from this software
+        without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY Kentoku SHIBA "AS IS" AND ANY EXPRESS OR
+  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+  EVENT SHALL Kentoku SHIBA BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <atbuiltin_rwlock.h>
+
+#define NUMBER_OF_THREADS 100
+#define NUMBER_OF_LOOPS 1000000
+#define NUMBER_OF_LOCKS 16
+#define NUMBER_OF_UNWIND_LOCKS 65536
+
+#ifdef ATBUILTIN_RWLOCK_READ_PRIORITY_TEST
+#define OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_READ_PRIORITY
+#else
+#ifdef ATBUILTIN_RWLOCK_NO_PRIORITY_TEST
+#define OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_NO_PRIORITY
+#else
+#define OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WRITE_PRIORITY
+#endif
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_WAIT_FUTEX_TEST
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_FUTEX
+#else
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_PTHREAD
+#endif
+
+atbuiltin_rwlock_array_t array;
+volatile bool wlocking[NUMBER_OF_LOCKS];
+volatile int values[NUMBER_OF_LOCKS];
+
+void *worker_thread(void *arg)
+{
+  int i, res, index;
+  int worker_id = *((int *) arg);
+  atbuiltin_rwlock_t *rwlock;
+  for (i = 0; i < NUMBER_OF_LOOPS; i++)
+  {
+    index = (worker_id + i) % NUMBER_OF_LOCKS;
+    rwlock = atbuiltin_rwlock_array_get(&array, index);
+    if ((worker_id % NUMBER_OF_THREADS) < NUMBER_OF_THREADS / 10)
+    {
+      if (!(res = atbuiltin_rwlock_wlock(rwlock)))
+      {
+        if (wlocking[index])
+          printf("duplicate write locking of %d\n", index);
+        wlocking[index] = true;
+        values[index]++;
+        wlocking[index] = false;
+        atbuiltin_rwlock_wunlock(rwlock);
+      } else {
+        printf("write lock thread [%d] got %d\n", worker_id, res);
+      }
+    } else {
+      if (!(res = atbuiltin_rwlock_rlock(rwlock)))
+      {
+        if (wlocking[index])
+          printf("write locked after read locking of %d\n", index);
+        atbuiltin_rwlock_runlock(rwlock);
+      } else {
+        printf("read lock thread [%d] got %d\n", worker_id, res);
+      }
+    }
+  }
+  printf("%d is finished\n", worker_id);
+  return NULL;
+}
+
+/*
+  Locks and unlocks the locks of an array from all threads. Without attr and
+  ATBUILTIN_RWLOCK_ARRAY_LOCAL_NODE, the locks are left as zeroed memory and
+  set up by the first contention.
+*/
+int test_array(const atbuiltin_rwlock_attr_t *attr, int flags)
+{
+  int worker_id[NUMBER_OF_THREADS];
+  int i, res, sum = 0;
+  pthread_t threads[NUMBER_OF_THREADS];
+
+  if ((res = atbuiltin_rwlock_array_init(&array, NUMBER_OF_LOCKS, attr,
+    flags)))
+  {
+    printf("array init with flags %d got %d\n", flags, res);
+    return 1;
+  }
+  if (array.stride % ATBUILTIN_RWLOCK_CACHE_LINE_SIZE)
+    printf("array stride got %zu\n", array.stride);
+  for (i = 0; i < NUMBER_OF_LOCKS; i++)
+  {
+    wlocking[i] = false;
+    values[i] = 0;
+  }
+  for (i = 0; i < NUMBER_OF_THREADS; i++)
+  {
+    worker_id[i] = i;
+    if (pthread_create(&threads[i], NULL, worker_thread, &worker_id[i]))
+    {
+      return 1;
+    }
+  }
+  for (i = 0; i < NUMBER_OF_THREADS; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  for (i = 0; i < NUMBER_OF_LOCKS; i++)
+  {
+    sum += values[i];
+  }
+  if (sum != NUMBER_OF_THREADS / 10 * NUMBER_OF_LOOPS)
+    printf("array writers got %d writes\n", sum);
+  if ((res = atbuiltin_rwlock_array_destroy(&array)))
+    printf("array destroy with flags %d got %d\n", flags, res);
+  return 0;
+}
+
+/* returns the data size of this process in bytes, or 0 if unknown */
+size_t get_data_size()
+{
+  char line[256];
+  size_t size = 0;
+  FILE *file;
+  if (!(file = fopen("/proc/self/status", "r")))
+    return 0;
+  while (fgets(line, sizeof(line), file))
+  {
+    if (!strncmp(line, "VmData:", 7))
+    {
+      size = strtoull(line + 7, NULL, 10) * 1024;
+      break;
+    }
+  }
+  fclose(file);
+  return size;
+}
+
+/*
+  A lock which fails to initialize makes atbuiltin_rwlock_array_init destroy
+  the locks before it and release the memory. The per-CPU read counters of
+  each lock are allocated, so a small data limit makes a lock in the middle
+  of the array fail. If the limit is not enforced, this is skipped.
+*/
+int test_array_unwind(atbuiltin_rwlock_attr_t *attr)
+{
+  int res;
+  size_t data_size;
+  struct rlimit limit, old_limit;
+
+  if ((res = atbuiltin_rwlock_array_init(&array, 0, NULL, 0)) != EINVAL)
+    printf("array init of no lock got %d\n", res);
+  if ((res = atbuiltin_rwlock_array_init(&array, (size_t) -1, NULL, 0)) !=
+    EINVAL)
+    printf("array init of too many locks got %d\n", res);
+
+  atbuiltin_rwlockattr_settype_read_counter(attr,
+    ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU);
+  atbuiltin_rwlockattr_settype_read_max(attr, 4);
+  if ((res = atbuiltin_rwlock_array_init(&array, NUMBER_OF_LOCKS, attr, 0)) !=
+    EINVAL)
+    printf("array init of invalid attr got %d\n", res);
+  else if (array.memory)
+    printf("array memory is left after init failure\n");
+  atbuiltin_rwlockattr_settype_read_max(attr, 0);
+
+  if (!(data_size = get_data_size()) || getrlimit(RLIMIT_DATA, &old_limit))
+    return 0;
+  limit = old_limit;
+  limit.rlim_cur = data_size + NUMBER_OF_UNWIND_LOCKS *
+    (sizeof(atbuiltin_rwlock_t) + ATBUILTIN_RWLOCK_CACHE_LINE_SIZE) +
+    256 * 1024;
+  if (setrlimit(RLIMIT_DATA, &limit))
+    return 0;
+  res = atbuiltin_rwlock_array_init(&array, NUMBER_OF_UNWIND_LOCKS, attr, 0);
+  setrlimit(RLIMIT_DATA, &old_limit);
+  if (!res)
+  {
+    atbuiltin_rwlock_array_destroy(&array);
+  } else if (res != ENOMEM) {
+    printf("array init over data limit got %d\n", res);
+  } else if (array.memory) {
+    printf("array memory is left after init failure\n");
+  }
+  atbuiltin_rwlockattr_settype_read_counter(attr,
+    ATBUILTIN_RWLOCK_READ_COUNTER_SHARED);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  time_t timer;
+  atbuiltin_rwlock_attr_t attr;
+
+  atbuiltin_rwlockattr_init(&attr);
+  atbuiltin_rwlockattr_settype_priority(&attr, OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_wait(&attr, WAIT_OPTION_OF_RWLOCKATTR);
+
+  timer = time(NULL);
+  printf("%s\n", ctime(&timer));
+  if (
+    test_array(NULL, ATBUILTIN_RWLOCK_ARRAY_HUGEPAGE) ||
+    test_array(NULL, ATBUILTIN_RWLOCK_ARRAY_LOCAL_NODE) ||
+    test_array(&attr, ATBUILTIN_RWLOCK_ARRAY_HUGEPAGE |
+      ATBUILTIN_RWLOCK_ARRAY_LOCAL_NODE) ||
+    test_array_unwind(&attr)
+  ) {
+    return 1;
+  }
+
+  timer = time(NULL);
+  printf("%s\n", ctime(&timer));
+  atbuiltin_rwlockattr_destroy(&attr);
+  return 0;
+}
@@ -45,6 +45,12 @@
 #endif
 #endif
 
+#ifdef ATBUILTIN_RWLOCK_WAIT_FUTEX_TEST
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_FUTEX
+#else
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_PTHREAD
+#endif
+
 atbuiltin_rwlock_t rwlock;
 volatile bool rlocking;
 volatile bool wlocking;
@@ -200,6 +206,7 @@ void *worker_thread(void *arg)
     }
     printf("%d is finished\n", worker_id);
   }
+  return NULL;
 }
 
 int main(int argc, char **argv)
@@ -217,6 +224,7 @@ int main(int argc, char **argv)
   pthread_attr_init(&pthread_attr);
   atbuiltin_rwlockattr_init(&attr);
   atbuiltin_rwlockattr_settype_priority(&attr, OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_wait(&attr, WAIT_OPTION_OF_RWLOCKATTR);
   atbuiltin_rwlockattr_settype_write_lock_interval(&attr, 1);
   atbuiltin_rwlock_init(&rwlock, &attr);
 
@@ -40,11 +40,97 @@
 #ifdef ATBUILTIN_RWLOCK_NO_PRIORITY_TEST
 #define OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_NO_PRIORITY
 #else
+#ifdef ATBUILTIN_RWLOCK_PHASE_FAIR_TEST
+#define OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_PHASE_FAIR
+#else
+#ifdef ATBUILTIN_RWLOCK_ADAPTIVE_TEST
+#define OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_ADAPTIVE
+#else
 #define OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WRITE_PRIORITY
 #endif
 #endif
+#endif
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_WAIT_FUTEX_TEST
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_FUTEX
+#else
+#ifdef ATBUILTIN_RWLOCK_WAIT_QUEUE_TEST
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_QUEUE
+#else
+#ifdef ATBUILTIN_RWLOCK_WAIT_SPIN_TEST
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_SPIN
+#else
+#ifdef ATBUILTIN_RWLOCK_WAIT_PI_TEST
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_PI
+#else
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_PTHREAD
+#endif
+#endif
+#endif
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_SPIN_ADAPTIVE_TEST
+#define SPIN_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_SPIN_ADAPTIVE
+#else
+#define SPIN_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_SPIN_FIXED
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_BACKOFF_EXPONENTIAL_TEST
+#define BACKOFF_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_BACKOFF_EXPONENTIAL
+#else
+#define BACKOFF_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_BACKOFF_NONE
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU_TEST
+#define READ_COUNTER_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU
+#else
+#define READ_COUNTER_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_READ_COUNTER_SHARED
+#endif
 
+#ifdef ATBUILTIN_RWLOCK_BIAS_READ_TEST
+#define BIAS_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_BIAS_READ
+#else
+#define BIAS_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_BIAS_NONE
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_COHORT_NUMA_TEST
+#define COHORT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_COHORT_NUMA
+#else
+#define COHORT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_COHORT_NONE
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_QUEUE_ORDER_DEADLINE_TEST
+#define QUEUE_ORDER_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_QUEUE_ORDER_DEADLINE
+#else
+#define QUEUE_ORDER_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_QUEUE_ORDER_FIFO
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_WRITE_WAIT_CAP_TEST
+#define WRITE_WAIT_CAP_OF_RWLOCKATTR 1000000
+#else
+#define WRITE_WAIT_CAP_OF_RWLOCKATTR 0
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_WRITE_BATCH_TEST
+#define WRITE_BATCH_OF_RWLOCKATTR 4
+#define WRITE_BATCH_TIME_OF_RWLOCKATTR 1000000
+#else
+#define WRITE_BATCH_OF_RWLOCKATTR 0
+#define WRITE_BATCH_TIME_OF_RWLOCKATTR 0
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_READ_MAX_TEST
+#define READ_MAX_OF_RWLOCKATTR 4
+#else
+#define READ_MAX_OF_RWLOCKATTR 0
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_INITIALIZER_TEST
+atbuiltin_rwlock_t rwlock = ATBUILTIN_RWLOCK_INITIALIZER;
+#else
 atbuiltin_rwlock_t rwlock;
+#endif
 volatile bool rlocking;
 volatile bool wlocking;
 
@@ -83,6 +169,7 @@ void *worker_thread(void *arg)
     }
   }
   printf("%d is finished\n", worker_id);
+  return NULL;
 }
 
 int main(int argc, char **argv)
@@ -100,7 +187,20 @@ int main(int argc, char **argv)
   pthread_attr_init(&pthread_attr);
   atbuiltin_rwlockattr_init(&attr);
   atbuiltin_rwlockattr_settype_priority(&attr, OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_wait(&attr, WAIT_OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_spin(&attr, SPIN_OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_backoff(&attr, BACKOFF_OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_read_counter(&attr, READ_COUNTER_OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_bias(&attr, BIAS_OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_cohort(&attr, COHORT_OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_queue_order(&attr, QUEUE_ORDER_OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_write_wait_cap(&attr, WRITE_WAIT_CAP_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_write_batch(&attr, WRITE_BATCH_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_write_batch_time(&attr, WRITE_BATCH_TIME_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_read_max(&attr, READ_MAX_OF_RWLOCKATTR);
+#ifndef ATBUILTIN_RWLOCK_INITIALIZER_TEST
   atbuiltin_rwlock_init(&rwlock, &attr);
+#endif
 
   timer = time(NULL);
   printf("%s\n", ctime(&timer));
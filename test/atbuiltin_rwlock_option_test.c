@@ -0,0 +1,295 @@
+/*
+  Tests of atbuiltin RW lock functions
+
+  Copyright (C) 2014, Kentoku SHIBA
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+      * Redistributions of source code must retain the above copyright
+        notice, this list of conditions and the following disclaimer.
+      * Redistributions in binary form must reproduce the above copyright
+        notice, this list of conditions and the following disclaimer in the
+        documentation and/or other materials provided with the distribution.
+      * Neither the name of Kentoku SHIBA nor the names of its contributors
+        may be used to endorse or promote products derived from this software
+        without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY Kentoku SHIBA "AS IS" AND ANY EXPRESS OR
+  IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+  EVENT SHALL Kentoku SHIBA BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+  OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+  WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+  OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+  ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <atbuiltin_rwlock.h>
+
+#define NUMBER_OF_THREADS 100
+#define NUMBER_OF_LOOPS 1000000
+
+#define READ_MAX 4
+#define WRITE_BATCH 2
+#define NUMBER_OF_BATCH_WRITERS 4
+#define WRITE_WAIT_CAP 50000000
+
+#ifdef ATBUILTIN_RWLOCK_WAIT_FUTEX_TEST
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_FUTEX
+#else
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_PTHREAD
+#endif
+
+atbuiltin_rwlock_t rwlock;
+volatile int readers;
+volatile int writes;
+volatile int writes_before_read;
+
+/* waits until lock_body has count of what one counts */
+void wait_for_lock_body(atbuiltin_rwlock_state one, atbuiltin_rwlock_state mask, unsigned int count)
+{
+  while ((*((volatile atbuiltin_rwlock_state *) &rwlock.lock_body) & mask) /
+    one != count)
+  {
+    sched_yield();
+  }
+}
+
+void *worker_thread(void *arg)
+{
+  int i, res, cnt;
+  int worker_id = *((int *) arg);
+  if ((worker_id % NUMBER_OF_THREADS) < NUMBER_OF_THREADS / 10)
+  {
+    for (i = 0; i < NUMBER_OF_LOOPS; i++)
+    {
+      if (!(res = atbuiltin_rwlock_wlock(&rwlock)))
+      {
+        if (readers)
+          printf("read locked after write locking\n");
+        atbuiltin_rwlock_wunlock(&rwlock);
+      } else {
+        printf("write lock thread [%d] got %d\n", worker_id, res);
+      }
+    }
+  } else {
+    for (i = 0; i < NUMBER_OF_LOOPS; i++)
+    {
+      if (!(res = atbuiltin_rwlock_rlock(&rwlock)))
+      {
+        if ((cnt = __sync_add_and_fetch(&readers, 1)) > READ_MAX)
+          printf("read lock thread [%d] got %d readers\n", worker_id, cnt);
+        sched_yield();
+        __sync_sub_and_fetch(&readers, 1);
+        atbuiltin_rwlock_runlock(&rwlock);
+      } else {
+        printf("read lock thread [%d] got %d\n", worker_id, res);
+      }
+    }
+  }
+  printf("%d is finished\n", worker_id);
+  return NULL;
+}
+
+void *batch_reader_thread(void *arg)
+{
+  int res;
+  if (!(res = atbuiltin_rwlock_rlock(&rwlock)))
+  {
+    writes_before_read = writes;
+    atbuiltin_rwlock_runlock(&rwlock);
+  } else {
+    printf("batch read lock thread got %d\n", res);
+  }
+  return NULL;
+}
+
+void *batch_writer_thread(void *arg)
+{
+  int res;
+  if (!(res = atbuiltin_rwlock_wlock(&rwlock)))
+  {
+    writes++;
+    atbuiltin_rwlock_wunlock(&rwlock);
+  } else {
+    printf("batch write lock thread got %d\n", res);
+  }
+  return NULL;
+}
+
+/*
+  read_max: readers never hold the lock more than READ_MAX at same time, and
+  a reader over it waits until one of them releases.
+*/
+int test_read_max(atbuiltin_rwlock_attr_t *attr)
+{
+  int worker_id[NUMBER_OF_THREADS];
+  int i, res;
+  pthread_t threads[NUMBER_OF_THREADS];
+
+  atbuiltin_rwlockattr_settype_priority(attr, ATBUILTIN_RWLOCK_NO_PRIORITY);
+  atbuiltin_rwlockattr_settype_read_max(attr, READ_MAX);
+  if ((res = atbuiltin_rwlock_init(&rwlock, attr)))
+  {
+    printf("read max init got %d\n", res);
+    return 1;
+  }
+  for (i = 0; i < READ_MAX; i++)
+  {
+    atbuiltin_rwlock_rlock(&rwlock);
+  }
+  if ((res = atbuiltin_rwlock_tryrlock(&rwlock)) != EBUSY)
+    printf("read max tryrlock got %d\n", res);
+  if (pthread_create(&threads[0], NULL, batch_reader_thread, NULL))
+  {
+    return 1;
+  }
+  wait_for_lock_body(ATBUILTIN_RWLOCK_READ_WAITER_ONE,
+    ATBUILTIN_RWLOCK_READ_WAITER_MASK, 1);
+  atbuiltin_rwlock_runlock(&rwlock);
+  pthread_join(threads[0], NULL);
+  for (i = 1; i < READ_MAX; i++)
+  {
+    atbuiltin_rwlock_runlock(&rwlock);
+  }
+
+  readers = 0;
+  for (i = 0; i < NUMBER_OF_THREADS; i++)
+  {
+    worker_id[i] = i;
+    if (pthread_create(&threads[i], NULL, worker_thread, &worker_id[i]))
+    {
+      return 1;
+    }
+  }
+  for (i = 0; i < NUMBER_OF_THREADS; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  atbuiltin_rwlock_destroy(&rwlock);
+  atbuiltin_rwlockattr_settype_read_max(attr, 0);
+  return 0;
+}
+
+/*
+  write_batch: with write priority, a waiting reader gets the lock after it
+  is passed between writers WRITE_BATCH times, before the other writers.
+*/
+int test_write_batch(atbuiltin_rwlock_attr_t *attr)
+{
+  int i, res;
+  pthread_t reader;
+  pthread_t writers[NUMBER_OF_BATCH_WRITERS];
+
+  atbuiltin_rwlockattr_settype_priority(attr, ATBUILTIN_RWLOCK_WRITE_PRIORITY);
+  atbuiltin_rwlockattr_settype_write_batch(attr, WRITE_BATCH);
+  if ((res = atbuiltin_rwlock_init(&rwlock, attr)))
+  {
+    printf("write batch init got %d\n", res);
+    return 1;
+  }
+  writes = 0;
+  writes_before_read = -1;
+  atbuiltin_rwlock_wlock(&rwlock);
+  if (pthread_create(&reader, NULL, batch_reader_thread, NULL))
+  {
+    return 1;
+  }
+  wait_for_lock_body(ATBUILTIN_RWLOCK_READ_WAITER_ONE,
+    ATBUILTIN_RWLOCK_READ_WAITER_MASK, 1);
+  for (i = 0; i < NUMBER_OF_BATCH_WRITERS; i++)
+  {
+    if (pthread_create(&writers[i], NULL, batch_writer_thread, NULL))
+    {
+      return 1;
+    }
+  }
+  wait_for_lock_body(ATBUILTIN_RWLOCK_WRITER_ONE,
+    ATBUILTIN_RWLOCK_WRITER_MASK, NUMBER_OF_BATCH_WRITERS + 1);
+  atbuiltin_rwlock_wunlock(&rwlock);
+  pthread_join(reader, NULL);
+  for (i = 0; i < NUMBER_OF_BATCH_WRITERS; i++)
+  {
+    pthread_join(writers[i], NULL);
+  }
+  if (writes_before_read != WRITE_BATCH)
+    printf("write batch reader got lock after %d writers\n",
+      writes_before_read);
+  atbuiltin_rwlock_destroy(&rwlock);
+  atbuiltin_rwlockattr_settype_write_batch(attr, 0);
+  return 0;
+}
+
+/*
+  write_wait_cap: with read priority, new readers get the lock while a writer
+  waits, until the writer has waited for WRITE_WAIT_CAP.
+*/
+int test_write_wait_cap(atbuiltin_rwlock_attr_t *attr)
+{
+  int res;
+  pthread_t writer;
+
+  atbuiltin_rwlockattr_settype_priority(attr, ATBUILTIN_RWLOCK_READ_PRIORITY);
+  atbuiltin_rwlockattr_settype_write_wait_cap(attr, WRITE_WAIT_CAP);
+  if ((res = atbuiltin_rwlock_init(&rwlock, attr)))
+  {
+    printf("write wait cap init got %d\n", res);
+    return 1;
+  }
+  writes = 0;
+  atbuiltin_rwlock_rlock(&rwlock);
+  if (pthread_create(&writer, NULL, batch_writer_thread, NULL))
+  {
+    return 1;
+  }
+  wait_for_lock_body(ATBUILTIN_RWLOCK_WRITER_ONE,
+    ATBUILTIN_RWLOCK_WRITER_MASK, 1);
+  if ((res = atbuiltin_rwlock_tryrlock(&rwlock)))
+    printf("write wait cap tryrlock before cap got %d\n", res);
+  else
+    atbuiltin_rwlock_runlock(&rwlock);
+  usleep(WRITE_WAIT_CAP / 1000 * 4);
+  if ((res = atbuiltin_rwlock_tryrlock(&rwlock)) != EBUSY)
+    printf("write wait cap tryrlock after cap got %d\n", res);
+  if (!res)
+    atbuiltin_rwlock_runlock(&rwlock);
+  atbuiltin_rwlock_runlock(&rwlock);
+  pthread_join(writer, NULL);
+  if (writes != 1)
+    printf("write wait cap writer got %d writes\n", writes);
+  atbuiltin_rwlock_destroy(&rwlock);
+  atbuiltin_rwlockattr_settype_write_wait_cap(attr, 0);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  time_t timer;
+  atbuiltin_rwlock_attr_t attr;
+
+  atbuiltin_rwlockattr_init(&attr);
+  atbuiltin_rwlockattr_settype_wait(&attr, WAIT_OPTION_OF_RWLOCKATTR);
+
+  timer = time(NULL);
+  printf("%s\n", ctime(&timer));
+  if (
+    test_read_max(&attr) ||
+    test_write_batch(&attr) ||
+    test_write_wait_cap(&attr)
+  ) {
+    return 1;
+  }
+
+  timer = time(NULL);
+  printf("%s\n", ctime(&timer));
+  atbuiltin_rwlockattr_destroy(&attr);
+  return 0;
+}
@@ -44,6 +44,12 @@
 #endif
 #endif
 
+#ifdef ATBUILTIN_RWLOCK_WAIT_FUTEX_TEST
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_FUTEX
+#else
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_PTHREAD
+#endif
+
 atbuiltin_rwlock_t rwlock;
 
 void *worker_thread(void *arg)
@@ -80,6 +86,7 @@ void *worker_thread(void *arg)
       }
     }
   }
+  return NULL;
 }
 
 int main(int argc, char **argv)
@@ -95,6 +102,7 @@ int main(int argc, char **argv)
   pthread_attr_init(&pthread_attr);
   atbuiltin_rwlockattr_init(&attr);
   atbuiltin_rwlockattr_settype_priority(&attr, OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_wait(&attr, WAIT_OPTION_OF_RWLOCKATTR);
   atbuiltin_rwlock_init(&rwlock, &attr);
 
   timer = time(NULL);
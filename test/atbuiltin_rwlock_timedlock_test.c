@@ -41,20 +41,127 @@
 #ifdef ATBUILTIN_RWLOCK_NO_PRIORITY_TEST
 #define OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_NO_PRIORITY
 #else
+#ifdef ATBUILTIN_RWLOCK_PHASE_FAIR_TEST
+#define OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_PHASE_FAIR
+#else
+#ifdef ATBUILTIN_RWLOCK_ADAPTIVE_TEST
+#define OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_ADAPTIVE
+#else
 #define OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WRITE_PRIORITY
 #endif
 #endif
+#endif
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_WAIT_FUTEX_TEST
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_FUTEX
+#else
+#ifdef ATBUILTIN_RWLOCK_WAIT_QUEUE_TEST
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_QUEUE
+#else
+#ifdef ATBUILTIN_RWLOCK_WAIT_SPIN_TEST
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_SPIN
+#else
+#ifdef ATBUILTIN_RWLOCK_WAIT_PI_TEST
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_PI
+#else
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_PTHREAD
+#endif
+#endif
+#endif
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_SPIN_ADAPTIVE_TEST
+#define SPIN_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_SPIN_ADAPTIVE
+#else
+#define SPIN_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_SPIN_FIXED
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_BACKOFF_EXPONENTIAL_TEST
+#define BACKOFF_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_BACKOFF_EXPONENTIAL
+#else
+#define BACKOFF_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_BACKOFF_NONE
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU_TEST
+#define READ_COUNTER_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_READ_COUNTER_PERCPU
+#else
+#define READ_COUNTER_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_READ_COUNTER_SHARED
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_BIAS_READ_TEST
+#define BIAS_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_BIAS_READ
+#else
+#define BIAS_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_BIAS_NONE
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_COHORT_NUMA_TEST
+#define COHORT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_COHORT_NUMA
+#else
+#define COHORT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_COHORT_NONE
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_QUEUE_ORDER_DEADLINE_TEST
+#define QUEUE_ORDER_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_QUEUE_ORDER_DEADLINE
+#else
+#define QUEUE_ORDER_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_QUEUE_ORDER_FIFO
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_WRITE_WAIT_CAP_TEST
+#define WRITE_WAIT_CAP_OF_RWLOCKATTR 1000000
+#else
+#define WRITE_WAIT_CAP_OF_RWLOCKATTR 0
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_WRITE_BATCH_TEST
+#define WRITE_BATCH_OF_RWLOCKATTR 4
+#define WRITE_BATCH_TIME_OF_RWLOCKATTR 1000000
+#else
+#define WRITE_BATCH_OF_RWLOCKATTR 0
+#define WRITE_BATCH_TIME_OF_RWLOCKATTR 0
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_READ_MAX_TEST
+#define READ_MAX_OF_RWLOCKATTR 4
+#else
+#define READ_MAX_OF_RWLOCKATTR 0
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_CLOCK_MONOTONIC_TEST
+#define CLOCK_OF_TIMEDLOCK CLOCK_MONOTONIC
+#else
+#ifdef ATBUILTIN_RWLOCK_CLOCK_REALTIME_TEST
+#define CLOCK_OF_TIMEDLOCK CLOCK_REALTIME
+#endif
+#endif
 
 atbuiltin_rwlock_t rwlock;
 volatile bool rlocking;
 volatile bool wlocking;
 
+#ifdef CLOCK_OF_TIMEDLOCK
+void set_deadline(struct timespec *abstime, const struct timespec *timeout)
+{
+  clock_gettime(CLOCK_OF_TIMEDLOCK, abstime);
+  abstime->tv_sec += timeout->tv_sec;
+  abstime->tv_nsec += timeout->tv_nsec;
+  if (abstime->tv_nsec >= 1000000000)
+  {
+    abstime->tv_sec++;
+    abstime->tv_nsec -= 1000000000;
+  }
+}
+#endif
+
 void *worker_thread(void *arg)
 {
   int i, res;
   int worker_id = *((int *) arg);
   unsigned int tout_cnt = 0;
   struct timespec timeout;
+#ifdef CLOCK_OF_TIMEDLOCK
+  struct timespec abstime;
+#endif
   timeout.tv_sec = 0;
   if ((worker_id % NUMBER_OF_THREADS) < NUMBER_OF_THREADS / 10)
   {
@@ -62,7 +169,13 @@ void *worker_thread(void *arg)
     for (i = 0; i < NUMBER_OF_LOOPS; i++)
     {
       do {
-        if (!(res = atbuiltin_rwlock_timedwlock(&rwlock, &timeout)))
+#ifdef CLOCK_OF_TIMEDLOCK
+        set_deadline(&abstime, &timeout);
+        res = atbuiltin_rwlock_clockwlock(&rwlock, CLOCK_OF_TIMEDLOCK, &abstime);
+#else
+        res = atbuiltin_rwlock_timedwlock(&rwlock, &timeout);
+#endif
+        if (!res)
         {
           wlocking = true;
           if (rlocking)
@@ -81,7 +194,13 @@ void *worker_thread(void *arg)
     for (i = 0; i < NUMBER_OF_LOOPS; i++)
     {
       do {
-        if (!(res = atbuiltin_rwlock_timedrlock(&rwlock, &timeout)))
+#ifdef CLOCK_OF_TIMEDLOCK
+        set_deadline(&abstime, &timeout);
+        res = atbuiltin_rwlock_clockrlock(&rwlock, CLOCK_OF_TIMEDLOCK, &abstime);
+#else
+        res = atbuiltin_rwlock_timedrlock(&rwlock, &timeout);
+#endif
+        if (!res)
         {
           rlocking = true;
           if (wlocking)
@@ -97,6 +216,7 @@ void *worker_thread(void *arg)
     }
   }
   printf("%d timeout count is %u\n", worker_id, tout_cnt);
+  return NULL;
 }
 
 int main(int argc, char **argv)
@@ -114,6 +234,17 @@ int main(int argc, char **argv)
   pthread_attr_init(&pthread_attr);
   atbuiltin_rwlockattr_init(&attr);
   atbuiltin_rwlockattr_settype_priority(&attr, OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_wait(&attr, WAIT_OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_spin(&attr, SPIN_OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_backoff(&attr, BACKOFF_OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_read_counter(&attr, READ_COUNTER_OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_bias(&attr, BIAS_OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_cohort(&attr, COHORT_OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_queue_order(&attr, QUEUE_ORDER_OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_write_wait_cap(&attr, WRITE_WAIT_CAP_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_write_batch(&attr, WRITE_BATCH_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_write_batch_time(&attr, WRITE_BATCH_TIME_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_read_max(&attr, READ_MAX_OF_RWLOCKATTR);
   atbuiltin_rwlock_init(&rwlock, &attr);
 
   timer = time(NULL);
@@ -45,6 +45,18 @@
 #endif
 #endif
 
+#ifdef ATBUILTIN_RWLOCK_WAIT_FUTEX_TEST
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_FUTEX
+#else
+#define WAIT_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_WAIT_PTHREAD
+#endif
+
+#ifdef ATBUILTIN_RWLOCK_BACKOFF_EXPONENTIAL_TEST
+#define BACKOFF_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_BACKOFF_EXPONENTIAL
+#else
+#define BACKOFF_OPTION_OF_RWLOCKATTR ATBUILTIN_RWLOCK_BACKOFF_NONE
+#endif
+
 atbuiltin_rwlock_t rwlock;
 volatile bool rlocking;
 volatile bool wlocking;
@@ -54,10 +66,16 @@ void *worker_thread(void *arg)
   int i, res;
   int worker_id = *((int *) arg);
   unsigned int busy_cnt = 0;
+#ifdef ATBUILTIN_RWLOCK_BACKOFF_EXPONENTIAL_TEST
+  atbuiltin_rwlock_backoff_t backoff;
+#endif
   if ((worker_id % NUMBER_OF_THREADS) < NUMBER_OF_THREADS / 10)
   {
     for (i = 0; i < NUMBER_OF_LOOPS; i++)
     {
+#ifdef ATBUILTIN_RWLOCK_BACKOFF_EXPONENTIAL_TEST
+      atbuiltin_rwlock_backoff_init(&rwlock, &backoff);
+#endif
       do {
         if (!(res = atbuiltin_rwlock_trywlock(&rwlock)))
         {
@@ -70,8 +88,14 @@ void *worker_thread(void *arg)
           printf("write lock timeout %d\n", worker_id);
         } else {
           busy_cnt++;
+#ifdef ATBUILTIN_RWLOCK_BACKOFF_EXPONENTIAL_TEST
+          atbuiltin_rwlock_backoff(&rwlock, &backoff);
+#endif
         }
       } while (res == EBUSY);
+#ifdef ATBUILTIN_RWLOCK_BACKOFF_EXPONENTIAL_TEST
+      atbuiltin_rwlock_backoff_destroy(&rwlock, &backoff);
+#endif
     }
   } else {
     for (i = 0; i < NUMBER_OF_LOOPS; i++)
@@ -93,6 +117,7 @@ void *worker_thread(void *arg)
     }
   }
   printf("%d busy count is %u\n", worker_id, busy_cnt);
+  return NULL;
 }
 
 int main(int argc, char **argv)
@@ -101,6 +126,9 @@ int main(int argc, char **argv)
   struct tm *date;
   int worker_id[NUMBER_OF_THREADS];
   int i;
+#ifdef ATBUILTIN_RWLOCK_BACKOFF_EXPONENTIAL_TEST
+  atbuiltin_rwlock_backoff_stat_t backoff_stat;
+#endif
   pthread_t threads[NUMBER_OF_THREADS];
   pthread_attr_t pthread_attr;
   atbuiltin_rwlock_attr_t attr;
@@ -110,6 +138,8 @@ int main(int argc, char **argv)
   pthread_attr_init(&pthread_attr);
   atbuiltin_rwlockattr_init(&attr);
   atbuiltin_rwlockattr_settype_priority(&attr, OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_wait(&attr, WAIT_OPTION_OF_RWLOCKATTR);
+  atbuiltin_rwlockattr_settype_backoff(&attr, BACKOFF_OPTION_OF_RWLOCKATTR);
   atbuiltin_rwlock_init(&rwlock, &attr);
 
   timer = time(NULL);
@@ -130,6 +160,11 @@ int main(int argc, char **argv)
 
   timer = time(NULL);
   printf("%s\n", ctime(&timer));
+#ifdef ATBUILTIN_RWLOCK_BACKOFF_EXPONENTIAL_TEST
+  atbuiltin_rwlock_getstat_backoff(&rwlock, &backoff_stat);
+  printf("backoff spin steps %llu sleeps %llu sleep nanoseconds %llu\n",
+    backoff_stat.spin_steps, backoff_stat.sleeps, backoff_stat.sleep_nsec);
+#endif
   pthread_attr_destroy(&pthread_attr);
   atbuiltin_rwlock_destroy(&rwlock);
   atbuiltin_rwlockattr_destroy(&attr);